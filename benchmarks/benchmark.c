@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2021 Kian Cross
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/rash.h"
+
+/*
+ * Name of the lookup engine the benchmark was linked against.
+*/
+#ifndef BENCHMARK_LABEL
+#define BENCHMARK_LABEL "default"
+#endif
+
+/*
+ * Default number of keys stored in the table.
+*/
+#define BENCHMARK_DEFAULT_SIZE 1000000
+
+/*
+ * Number of times each set of lookups is repeated.
+*/
+#define BENCHMARK_ROUNDS 5
+
+/*
+ * Number of keys looked up together by the batched lookups.
+*/
+#define BENCHMARK_BATCH_SIZE 64
+
+/*
+ * Number of threads used by the parallel insert.
+*/
+#define BENCHMARK_THREADS 4
+
+/*
+ * Maximum length of a generated key (including the terminator).
+*/
+#define BENCHMARK_KEY_SIZE 32
+
+/*
+ * Generate N keys with a given prefix into a single block of
+ * memory, each taking BENCHMARK_KEY_SIZE bytes.
+*/
+static char *benchmark_keys_create(const char *prefix, size_t n) {
+
+  char *keys = malloc(n * BENCHMARK_KEY_SIZE);
+  if (!keys) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    snprintf(
+      keys + i * BENCHMARK_KEY_SIZE,
+      BENCHMARK_KEY_SIZE,
+      "%s%zu",
+      prefix,
+      i
+    );
+  }
+
+  return keys;
+}
+
+/*
+ * Generate N keys where a given percentage are taken from the hits
+ * and the rest from the misses.
+*/
+static char *benchmark_keys_mix(
+  const char *hits,
+  const char *misses,
+  size_t n,
+  unsigned int hit_percentage
+) {
+
+  char *keys = malloc(n * BENCHMARK_KEY_SIZE);
+  if (!keys) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    const char *source = (i % 100 < hit_percentage) ? hits : misses;
+    memcpy(
+      keys + i * BENCHMARK_KEY_SIZE,
+      source + i * BENCHMARK_KEY_SIZE,
+      BENCHMARK_KEY_SIZE
+    );
+  }
+
+  return keys;
+}
+
+/*
+ * Number of seconds elapsed since start.
+*/
+static double benchmark_elapsed(clock_t start) {
+  return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+/*
+ * Number of seconds since some fixed point, which (unlike clock)
+ * doesn't add up the time spent by each thread.
+*/
+static double benchmark_wall_time(void) {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+#else
+  return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+ * Print the throughput of a number of operations done in a
+ * given time.
+*/
+static void benchmark_report(
+  const char *name,
+  size_t operations,
+  double seconds
+) {
+  printf(
+    "%-8s %-24s %10.2f Mops/s\n",
+    BENCHMARK_LABEL,
+    name,
+    operations / seconds / 1e6
+  );
+}
+
+/*
+ * Look up every key in the table BENCHMARK_ROUNDS times, returning the
+ * number of keys that were found.
+*/
+static size_t benchmark_lookups(
+  const char *name,
+  const struct hash_table *table,
+  const char *keys,
+  size_t n
+) {
+
+  size_t found = 0;
+  clock_t start = clock();
+
+  for (int round = 0; round < BENCHMARK_ROUNDS; round++) {
+    for (size_t i = 0; i < n; i++) {
+      if (hash_table_get(table, keys + i * BENCHMARK_KEY_SIZE)) {
+        found++;
+      }
+    }
+  }
+
+  benchmark_report(name, n * BENCHMARK_ROUNDS, benchmark_elapsed(start));
+
+  return found;
+}
+
+/*
+ * Same as benchmark_lookups, but looking up BENCHMARK_BATCH_SIZE keys
+ * at a time with hash_table_get_batch.
+*/
+static size_t benchmark_lookups_batch(
+  const char *name,
+  const struct hash_table *table,
+  const char *keys,
+  size_t n
+) {
+
+  const char *batch[BENCHMARK_BATCH_SIZE];
+  void *data[BENCHMARK_BATCH_SIZE];
+
+  size_t found = 0;
+  clock_t start = clock();
+
+  for (int round = 0; round < BENCHMARK_ROUNDS; round++) {
+    for (size_t i = 0; i < n; i += BENCHMARK_BATCH_SIZE) {
+
+      size_t count =
+        n - i < BENCHMARK_BATCH_SIZE ? n - i : BENCHMARK_BATCH_SIZE;
+
+      for (size_t j = 0; j < count; j++) {
+        batch[j] = keys + (i + j) * BENCHMARK_KEY_SIZE;
+      }
+
+      hash_table_get_batch(table, batch, count, data);
+
+      for (size_t j = 0; j < count; j++) {
+        if (data[j]) {
+          found++;
+        }
+      }
+    }
+  }
+
+  benchmark_report(name, n * BENCHMARK_ROUNDS, benchmark_elapsed(start));
+
+  return found;
+}
+
+int main(int argc, char **argv) {
+
+  size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCHMARK_DEFAULT_SIZE;
+
+  char *hit_keys = benchmark_keys_create("key_", n);
+  char *miss_keys = benchmark_keys_create("miss_", n);
+
+  struct hash_table *table = hash_table_create();
+  if (!table) {
+    return EXIT_FAILURE;
+  }
+
+  clock_t start = clock();
+
+  for (size_t i = 0; i < n; i++) {
+    if (!hash_table_add(table, hit_keys + i * BENCHMARK_KEY_SIZE, table)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  benchmark_report("insert", n, benchmark_elapsed(start));
+
+  // The same again, but with the table sized up front.
+  struct hash_table *reserved = hash_table_create_with_capacity(n);
+  if (!reserved) {
+    return EXIT_FAILURE;
+  }
+
+  start = clock();
+
+  for (size_t i = 0; i < n; i++) {
+    if (!hash_table_add(reserved, hit_keys + i * BENCHMARK_KEY_SIZE, table)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  benchmark_report("insert (reserved)", n, benchmark_elapsed(start));
+
+  hash_table_free(reserved);
+
+  // The same again, but adding every key in one batch.
+  struct hash_table_pair *pairs = malloc(n * sizeof(*pairs));
+  struct hash_table *batch = hash_table_create();
+  if (!pairs || !batch) {
+    return EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    pairs[i].key = hit_keys + i * BENCHMARK_KEY_SIZE;
+    pairs[i].data = table;
+  }
+
+  start = clock();
+
+  if (!hash_table_add_batch(batch, pairs, n)) {
+    return EXIT_FAILURE;
+  }
+
+  benchmark_report("insert (batched)", n, benchmark_elapsed(start));
+
+  hash_table_free(batch);
+
+  // And again, split across threads.
+  struct hash_table *parallel = hash_table_create();
+  if (!parallel) {
+    return EXIT_FAILURE;
+  }
+
+  double wall_start = benchmark_wall_time();
+
+  if (!hash_table_add_parallel(parallel, pairs, n, BENCHMARK_THREADS)) {
+    return EXIT_FAILURE;
+  }
+
+  benchmark_report(
+    "insert (parallel)",
+    n,
+    benchmark_wall_time() - wall_start
+  );
+
+  hash_table_free(parallel);
+  free(pairs);
+
+  size_t hits = benchmark_lookups("lookup (hit)", table, hit_keys, n);
+  size_t misses = benchmark_lookups("lookup (miss)", table, miss_keys, n);
+
+  // Mostly negative lookups, as seen by a cache.
+  char *mixed_keys = benchmark_keys_mix(hit_keys, miss_keys, n, 30);
+  size_t mixed = benchmark_lookups("lookup (70% miss)", table, mixed_keys, n);
+
+  size_t batched = benchmark_lookups_batch(
+    "lookup (hit, batched)",
+    table,
+    hit_keys,
+    n
+  );
+
+  if (
+    hits != n * BENCHMARK_ROUNDS ||
+    misses != 0 ||
+    mixed > hits ||
+    batched != hits
+  ) {
+    fprintf(stderr, "Lookups returned the wrong results\n");
+    return EXIT_FAILURE;
+  }
+
+  hash_table_free(table);
+  free(hit_keys);
+  free(miss_keys);
+  free(mixed_keys);
+
+  return 0;
+}
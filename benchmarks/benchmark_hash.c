@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2021 Kian Cross
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/rash_hash.h"
+
+/*
+ * Number of hashes computed for each key length when measuring
+ * throughput.
+*/
+#define BENCHMARK_HASH_ITERATIONS 10000000
+
+/*
+ * Size of the random buffer that keys are taken from.
+*/
+#define BENCHMARK_HASH_BUFFER_SIZE 4096
+
+/*
+ * Number of keys used to measure the distribution of hashes.
+*/
+#define BENCHMARK_HASH_KEYS (1 << 20)
+
+/*
+ * Number of bits of the hash used to pick a position when measuring
+ * the distribution (the same way fibonacci_hash does in the table).
+*/
+#define BENCHMARK_HASH_POSITION_BITS 16
+
+/*
+ * Number of random inputs used to measure avalanche.
+*/
+#define BENCHMARK_HASH_AVALANCHE_INPUTS 2000
+
+/*
+ * Length of the random inputs used to measure avalanche.
+*/
+#define BENCHMARK_HASH_AVALANCHE_LENGTH 16
+
+/*
+ * 2^64 / golden ratio (as used by fibonacci_hash).
+*/
+#define BENCHMARK_HASH_FIBONACCI_MULTIPLIER 11400714819323198485llu
+
+/*
+ * A hash function being benchmarked.
+*/
+struct benchmark_hash {
+  const char *name;
+  rash_hash_function function;
+};
+
+/*
+ * Key lengths used to measure throughput.
+*/
+static const size_t benchmark_hash_lengths[] = {
+  4, 8, 16, 24, 32, 48, 64, 128, 256, 1024
+};
+
+/*
+ * Measure the throughput of a hash function for a given key length.
+*/
+static void benchmark_hash_throughput(
+  const struct benchmark_hash *hash,
+  const uint8_t *buffer,
+  size_t length
+) {
+
+  uint64_t checksum = 0;
+  size_t offsets = BENCHMARK_HASH_BUFFER_SIZE - length;
+
+  clock_t start = clock();
+
+  for (size_t i = 0; i < BENCHMARK_HASH_ITERATIONS; i++) {
+    checksum ^= hash->function(buffer + (i * 7) % offsets, length, i);
+  }
+
+  double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  printf(
+    "%-8s length %4zu %10.2f Mhash/s %8.2f GB/s (%016llx)\n",
+    hash->name,
+    length,
+    BENCHMARK_HASH_ITERATIONS / seconds / 1e6,
+    BENCHMARK_HASH_ITERATIONS * (double) length / seconds / 1e9,
+    (unsigned long long) checksum
+  );
+}
+
+/*
+ * Chi-squared statistic of counts in a number of bins divided by the
+ * degrees of freedom. Values close to one indicate a uniform
+ * distribution.
+*/
+static double benchmark_hash_chi_squared(
+  const size_t *counts,
+  size_t bins,
+  size_t total
+) {
+
+  double expected = (double) total / bins;
+  double sum = 0;
+
+  for (size_t i = 0; i < bins; i++) {
+    double difference = counts[i] - expected;
+    sum += difference * difference / expected;
+  }
+
+  return sum / (bins - 1);
+}
+
+/*
+ * Measure how evenly a hash function spreads a set of keys over
+ * positions (the top bits after fibonacci hashing) and tags (the
+ * bottom byte).
+*/
+static void benchmark_hash_distribution(
+  const struct benchmark_hash *hash,
+  const char *key_set,
+  const char *format
+) {
+
+  size_t position_bins = (size_t) 1 << BENCHMARK_HASH_POSITION_BITS;
+  size_t *positions = calloc(position_bins, sizeof(*positions));
+  size_t tags[256] = {0};
+
+  if (!positions) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < BENCHMARK_HASH_KEYS; i++) {
+
+    char key[128];
+    int length = snprintf(key, sizeof(key), format, i);
+
+    uint64_t value = hash->function(key, length, 0);
+
+    positions[
+      (value * BENCHMARK_HASH_FIBONACCI_MULTIPLIER) >>
+      (64 - BENCHMARK_HASH_POSITION_BITS)
+    ]++;
+
+    tags[value & 0xff]++;
+  }
+
+  printf(
+    "%-8s %-6s position chi2/df %6.3f   tag chi2/df %8.3f\n",
+    hash->name,
+    key_set,
+    benchmark_hash_chi_squared(positions, position_bins, BENCHMARK_HASH_KEYS),
+    benchmark_hash_chi_squared(tags, 256, BENCHMARK_HASH_KEYS)
+  );
+
+  free(positions);
+}
+
+/*
+ * Measure the worst bias of any output bit when a single input bit
+ * is flipped (ideally every output bit flips half of the time).
+*/
+static void benchmark_hash_avalanche(const struct benchmark_hash *hash) {
+
+  static size_t flips[BENCHMARK_HASH_AVALANCHE_LENGTH * 8][64];
+  memset(flips, 0, sizeof(flips));
+
+  for (size_t i = 0; i < BENCHMARK_HASH_AVALANCHE_INPUTS; i++) {
+
+    uint8_t input[BENCHMARK_HASH_AVALANCHE_LENGTH];
+
+    for (size_t j = 0; j < sizeof(input); j++) {
+      input[j] = (uint8_t) rand();
+    }
+
+    uint64_t original = hash->function(input, sizeof(input), 0);
+
+    for (size_t bit = 0; bit < sizeof(input) * 8; bit++) {
+
+      input[bit / 8] ^= (uint8_t) (1 << (bit % 8));
+      uint64_t changed = original ^ hash->function(input, sizeof(input), 0);
+      input[bit / 8] ^= (uint8_t) (1 << (bit % 8));
+
+      for (size_t out = 0; out < 64; out++) {
+        flips[bit][out] += (changed >> out) & 1;
+      }
+    }
+  }
+
+  double worst = 0;
+
+  for (size_t bit = 0; bit < BENCHMARK_HASH_AVALANCHE_LENGTH * 8; bit++) {
+    for (size_t out = 0; out < 64; out++) {
+
+      double bias =
+        (double) flips[bit][out] / BENCHMARK_HASH_AVALANCHE_INPUTS - 0.5;
+
+      if (bias < 0) {
+        bias = -bias;
+      }
+
+      if (bias > worst) {
+        worst = bias;
+      }
+    }
+  }
+
+  printf("%-8s avalanche worst bias %.3f\n", hash->name, worst);
+}
+
+int main(void) {
+
+  struct benchmark_hash hashes[] = {
+    { "djb2", rash_hash_djb2 },
+    { "wyhash", rash_hash_wy },
+    { "crc32c", rash_hash_crc32c }
+  };
+
+  size_t hash_count = sizeof(hashes) / sizeof(hashes[0]);
+
+  if (!rash_hash_crc32c_supported()) {
+    hash_count--;
+  }
+
+  printf(
+    "Selected: %s\n\n",
+    rash_hash_select() == rash_hash_wy ? "wyhash" : "crc32c"
+  );
+
+  uint8_t buffer[BENCHMARK_HASH_BUFFER_SIZE];
+
+  srand(13);
+  for (size_t i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = (uint8_t) rand();
+  }
+
+  size_t length_count =
+    sizeof(benchmark_hash_lengths) / sizeof(benchmark_hash_lengths[0]);
+
+  for (size_t i = 0; i < length_count; i++) {
+    for (size_t j = 0; j < hash_count; j++) {
+      benchmark_hash_throughput(hashes + j, buffer, benchmark_hash_lengths[i]);
+    }
+  }
+
+  printf("\n");
+
+  for (size_t j = 0; j < hash_count; j++) {
+    benchmark_hash_distribution(hashes + j, "short", "key_%zu");
+    benchmark_hash_distribution(
+      hashes + j,
+      "url",
+      "https://example.com/api/v1/requests/0000-0000-%zu"
+    );
+    benchmark_hash_avalanche(hashes + j);
+  }
+
+  return 0;
+}
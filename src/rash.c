@@ -2,14 +2,90 @@
  * Copyright (C) 2021 Kian Cross
  */
 
+// MAP_ANONYMOUS and madvise are not part of strict C99 builds of
+// glibc.
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <assert.h>
+
+/*
+ * Use SIMD instructions to probe a group of buckets at a time, unless
+ * they have been disabled or are not available. SSE2 is part of the
+ * x86-64 baseline, AVX2 is used if the compiler has been told it is
+ * available.
+*/
+#if !defined(RASH_NO_SIMD) && (                                  \
+  defined(__SSE2__) || defined(_M_X64) ||                         \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)                        \
+)
+#define HASH_TABLE_SIMD
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+/*
+ * Large bucket arrays can be given their own memory mapping (so they
+ * can use huge pages) on POSIX systems.
+*/
+#if defined(__unix__) || defined(__APPLE__)
+#define HASH_TABLE_MMAP
+#include <sys/mman.h>
+#endif
+
+/*
+ * Bulk builds are split across threads if the library is built with
+ * pthreads (see hash_table_add_parallel).
+*/
+#if defined(RASH_THREADS)
+#include <pthread.h>
+#endif
 
 #include "rash.h"
+#include "rash_arena.h"
+#include "rash_hash.h"
+#include "rash_slab.h"
+
+/*
+ * Size of the huge pages mappings are aligned to (and rounded up to a
+ * multiple of). 2 MiB is the usual size on x86-64 and AArch64.
+*/
+#define HASH_TABLE_HUGE_PAGE_SIZE ((size_t) 2 * 1024 * 1024)
+
+/*
+ * Number of keys hashed (and whose buckets are prefetched) together by
+ * hash_table_get_batch, before any of them are looked up.
+*/
+#define HASH_TABLE_BATCH_SIZE 16
+
+/*
+ * Smallest range of buckets filled by each thread of a parallel build.
+ * Builds too small to give every thread this many buckets use fewer
+ * threads (or none at all).
+*/
+#define HASH_TABLE_BUILD_MIN_BUCKETS ((size_t) 1 << 16)
+
+/*
+ * Number of entries room is first made for when a thread of a parallel
+ * build has to leave one for later.
+*/
+#define HASH_TABLE_BUILD_MIN_DEFERRED 64
 
 /*
  * Initial exponent of 2 used for the size.
@@ -34,6 +110,51 @@
 */
 #define HASH_TABLE_LOAD_FACTOR_DECREASE 0.10f
 
+/*
+ * If the maximum probe count is exceeded while the load factor is
+ * below this, and the run of buckets is mostly made up of keys with
+ * the same desired position, the keys are probably colliding on
+ * purpose, so the table is rehashed with a new seed rather than being
+ * made bigger.
+*/
+#ifndef HASH_TABLE_LOAD_FACTOR_RESEED
+#define HASH_TABLE_LOAD_FACTOR_RESEED 0.50f
+#endif
+
+/*
+ * Smallest shift at which the table will be reseeded. Smaller tables
+ * have such short maximum probe counts that they regularly exceed
+ * them at a low load factor. This (and the other reseeding limits) can
+ * be overridden, so that reseeding is tested with small tables.
+*/
+#ifndef HASH_TABLE_RESEED_MIN_SHIFT
+#define HASH_TABLE_RESEED_MIN_SHIFT 10
+#endif
+
+/*
+ * Number of times the table can be reseeded without changing size,
+ * before it falls back to growing.
+*/
+#ifndef HASH_TABLE_MAX_RESEEDS
+#define HASH_TABLE_MAX_RESEEDS 3
+#endif
+
+/*
+ * Number of buckets of the old table looked at (or entries moved out of
+ * it) by each operation on a table which is growing incrementally. The
+ * old table must be empty before the table needs to grow again, which
+ * takes a few hundred thousand operations per million buckets at this
+ * rate.
+*/
+#define HASH_TABLE_MIGRATE_STEP 8
+
+/*
+ * The live keys in the arena of a table are copied into a new one once
+ * the space taken by keys that have been freed is over this fraction
+ * of the space taken by live ones (and at least a full block).
+*/
+#define HASH_TABLE_DEAD_KEYS_FACTOR 0.50f
+
 /*
  * Determine the size of the multiplier depending on size of
  * size_t on the system.
@@ -48,15 +169,77 @@
 #define FIBONACCI_MULTIPLIER 11400714819323198485llu
 #endif
 
+#ifdef HASH_TABLE_SIMD
+
+/*
+ * Operations on a group of distances or tags, which are compared
+ * with a single instruction.
+*/
+#if defined(__AVX2__)
+#define HASH_TABLE_GROUP_SIZE 32
+typedef __m256i hash_table_group;
+#define HASH_TABLE_GROUP_LOAD(p) _mm256_loadu_si256((const __m256i *) (p))
+#define HASH_TABLE_GROUP_SET(b) _mm256_set1_epi8((char) (b))
+#define HASH_TABLE_GROUP_ADD(a, b) _mm256_add_epi8((a), (b))
+#define HASH_TABLE_GROUP_AND(a, b) _mm256_and_si256((a), (b))
+#define HASH_TABLE_GROUP_EQ(a, b) _mm256_cmpeq_epi8((a), (b))
+#define HASH_TABLE_GROUP_LT(a, b) _mm256_cmpgt_epi8((b), (a))
+#define HASH_TABLE_GROUP_MASK(a) ((uint32_t) _mm256_movemask_epi8(a))
+#define HASH_TABLE_GROUP_OFFSETS()                                  \
+  _mm256_setr_epi8(                                                 \
+    1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,          \
+    17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32  \
+  )
+#else
+#define HASH_TABLE_GROUP_SIZE 16
+typedef __m128i hash_table_group;
+#define HASH_TABLE_GROUP_LOAD(p) _mm_loadu_si128((const __m128i *) (p))
+#define HASH_TABLE_GROUP_SET(b) _mm_set1_epi8((char) (b))
+#define HASH_TABLE_GROUP_ADD(a, b) _mm_add_epi8((a), (b))
+#define HASH_TABLE_GROUP_AND(a, b) _mm_and_si128((a), (b))
+#define HASH_TABLE_GROUP_EQ(a, b) _mm_cmpeq_epi8((a), (b))
+#define HASH_TABLE_GROUP_LT(a, b) _mm_cmplt_epi8((a), (b))
+#define HASH_TABLE_GROUP_MASK(a) ((uint32_t) _mm_movemask_epi8(a))
+#define HASH_TABLE_GROUP_OFFSETS()                                  \
+  _mm_setr_epi8(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16)
+#endif
+
+/*
+ * The distance and tag arrays are padded with a group of empty buckets
+ * so that a group can be loaded from any position within the table.
+*/
+#define HASH_TABLE_METADATA_PADDING HASH_TABLE_GROUP_SIZE
+
+#else
+#define HASH_TABLE_METADATA_PADDING 0
+#endif
+
+/*
+ * Start loading the cache line holding an address (for reading), if
+ * the compiler has a way to do it.
+*/
+#if defined(__GNUC__) || defined(__clang__)
+#define HASH_TABLE_PREFETCH(address) __builtin_prefetch((address), 0, 3)
+#elif defined(HASH_TABLE_SIMD)
+#define HASH_TABLE_PREFETCH(address) \
+  _mm_prefetch((const char *) (address), _MM_HINT_T0)
+#else
+#define HASH_TABLE_PREFETCH(address) ((void) (address))
+#endif
+
 /*
  * Macro used to iterate to the next available position in the hash table.
  * This is either an empty slot or a slot with an item that has the same
- * key.
+ * key. Only the probe metadata (distance and tag arrays) is read until a
+ * slot with a matching tag is found, and keys are only compared once the
+ * full hashes match.
  *
  *   table - The hash table.
  *
- *   key_value - Value of the key for which we are trying to find
- *               the next available position.
+ *   key - The key (a struct hash_table_key pointer) for which we are
+ *         trying to find the next available position.
+ *
+ *   tag - The tag (see hash_table_get_tag) of the key.
  *
  *   position - Initial value of the position for which this key corresponds.
  *              This value will be changed as we iterate. This must be a valid
@@ -66,7 +249,7 @@
  *   probe_count - The value of the probe count (number of iterations taken
  *                 to find a free space.
 */
-#define HASH_TABLE_ITERATE_TO_NEXT(table, key_value, position, probe_count) \
+#define HASH_TABLE_ITERATE_TO_NEXT(table, key, tag, position, probe_count) \
   for (                                                                     \
     (probe_count) = 0;                                                      \
                                                                             \
@@ -76,12 +259,42 @@
      * statement, evaluation stops.                                         \
     */                                                                      \
     (probe_count) < (table)->max_size_shift &&                              \
-    (table)->buckets[position] &&                                           \
-    strcmp(table->buckets[position]->key, key_value) != 0;                  \
+    (table)->buckets.dists[position] &&                                     \
+    (                                                                       \
+      (table)->buckets.tags[position] != (tag) ||                           \
+      !hash_table_entry_matches(                                            \
+        (table),                                                            \
+        &(table)->buckets.entries[position],                                \
+        (key)                                                               \
+      )                                                                     \
+    );                                                                      \
                                                                             \
     (probe_count)++, (position)++                                           \
   )
 
+/*
+ * Macro used to iterate through the buckets that could hold a key which
+ * wants a given position. Robin Hood hashing means that a key can never
+ * be past a bucket whose entry is closer to its own desired position
+ * than the key would be (which includes empty buckets), so iteration
+ * stops there rather than at the next empty bucket.
+ *
+ *   table - The hash table.
+ *
+ *   position - The desired position of the key. This value will be
+ *              changed as we iterate.
+ *
+ *   probe_count - The value of the probe count (distance of position
+ *                 from the desired position of the key).
+*/
+#define HASH_TABLE_ITERATE_CANDIDATES(table, position, probe_count) \
+  for (                                                             \
+    (probe_count) = 0;                                              \
+    (probe_count) < (table)->max_size_shift &&                      \
+    (table)->buckets.dists[position] > (probe_count);               \
+    (probe_count)++, (position)++                                   \
+  )
+
 /*
  * Macro used to generate a for loop that will iterate through every bucket.
 */
@@ -96,16 +309,119 @@
   HASH_TABLE_ITERATE_BUCKETS_TO_END(i, table->max_size, table->max_size_shift)
 
 /*
- * An entry (stored in a bucket), within the hash table.
+ * Keys shorter than this (including the terminator) are stored inside
+ * their entry, rather than being copied elsewhere. Most keys are under
+ * 24 bytes, and with 24 the entry would be padded to 48 bytes on a 64
+ * bit system anyway, so the padding is used for longer keys.
+*/
+#define HASH_TABLE_INLINE_KEY_SIZE 28
+
+/*
+ * An entry (stored in a bucket), within the hash table. Entries are
+ * stored inline in the bucket array.
 */
 struct hash_table_entry {
-  char *key;
   size_t hash;
   void *data;
 
-  // How many positions from its desired position the element
-  // is.
-  uint8_t dist_from_des;
+  // Length of the key (excluding the terminator).
+  uint32_t key_length;
+
+  // Short keys are stored here (along with their terminator). For
+  // longer keys this holds a (possibly unaligned) pointer to the key,
+  // and the last byte says who owns it (see hash_table_key_owner). Use
+  // hash_table_entry_get_key_value to get either.
+  char key[HASH_TABLE_INLINE_KEY_SIZE];
+};
+
+/*
+ * Position in the key of an entry of the byte which says who owns a
+ * key which isn't stored inline (after the pointer to it).
+*/
+#define HASH_TABLE_KEY_OWNER_INDEX (HASH_TABLE_INLINE_KEY_SIZE - 1)
+
+/*
+ * Who owns the key of an entry, if it isn't stored inline.
+*/
+enum hash_table_key_owner {
+
+  // A copy made by the table (stored in the way the table stores its
+  // keys).
+  HASH_TABLE_KEY_COPIED,
+
+  // The caller's own memory, which the table never frees.
+  HASH_TABLE_KEY_BORROWED,
+
+  // Memory from the allocator of the table, handed over by the caller
+  // and freed by the table.
+  HASH_TABLE_KEY_OWNED
+};
+
+/*
+ * A key being looked up (or inserted), along with its length and
+ * hash so that these are only worked out once per operation.
+*/
+struct hash_table_key {
+  const char *value;
+  size_t length;
+  size_t hash;
+};
+
+/*
+ * The buckets of a hash table, stored as a structure of arrays. The
+ * probe loops only need the distance and tag of a bucket to decide
+ * whether to carry on, so these are kept in dense byte arrays which
+ * sit apart from the (much larger) entries. All three arrays share
+ * a single allocation, which starts with the entries.
+*/
+struct hash_table_buckets {
+  struct hash_table_entry *entries;
+
+  // Size of the allocation (which starts with the entries).
+  size_t memory_size;
+
+  // Whether the allocation is a memory mapping of its own, rather
+  // than coming from the allocator.
+  bool mapped;
+
+  // How many positions from its desired position the element in
+  // each bucket is, plus one. Zero means that the bucket is empty.
+  uint8_t *dists;
+
+  // A fragment of the hash of the element in each bucket (only
+  // meaningful if the bucket is not empty).
+  uint8_t *tags;
+};
+
+/*
+ * Ways the copies of the keys in a table can be stored.
+*/
+enum hash_table_key_storage {
+
+  // Appended to the arena of the table (and moved when it is
+  // compacted).
+  HASH_TABLE_KEYS_ARENA,
+
+  // Shared with other tables, through an interner.
+  HASH_TABLE_KEYS_INTERNED
+};
+
+/*
+ * Keys shared between tables.
+*/
+struct hash_table_interner {
+
+  // Every shared key, with the number of entries using it stored as
+  // the data. The table only borrows the keys.
+  struct hash_table *keys;
+
+  // Where the shared keys are stored. Blocks from a slab never move,
+  // and freed ones are reused, which suits keys that are given out
+  // and given back one at a time.
+  struct rash_slab slab;
+
+  // Where all of the memory owned by the interner comes from.
+  struct hash_table_allocator allocator;
 };
 
 /*
@@ -121,9 +437,107 @@ struct hash_table {
 
   // Current number of elements in the hash table.
   size_t curr_size;
-  struct hash_table_entry **buckets;
+  struct hash_table_buckets buckets;
+
+  // Seed given to the built in hash function, and the built in hash
+  // function itself.
+  uint64_t seed;
+  rash_hash_function builtin_hash;
+
+  // Number of times the table has been reseeded since it last
+  // changed size.
+  uint8_t reseed_count;
+
+  // Whether the table grows incrementally (see hash_table_options).
+  bool incremental;
+
+  // While the table is growing incrementally, the table (sharing the
+  // seed and functions of this one) which holds the entries which are
+  // still to be moved across. NULL otherwise.
+  struct hash_table *old;
+
+  // Position of the next bucket of the old table to be moved. Every
+  // bucket before it is empty.
+  size_t migrate_position;
+
+  // Where the copies of the keys are made (shared with the old table,
+  // if there is one). Only the memory for the way the table stores its
+  // keys is used.
+  enum hash_table_key_storage key_storage;
+  struct rash_arena arena;
+  struct hash_table_interner *interner;
+
+  // Where all of the memory owned by the table comes from.
+  struct hash_table_allocator allocator;
+
+  // Size (in bytes) from which bucket arrays are mapped with huge
+  // pages, or zero if they never are (see hash_table_options).
+  size_t huge_page_threshold;
+
+  // Hash and equality functions (either of which may be NULL to
+  // use the built in ones), along with the context passed to them.
+  size_t (*hash)(const char *key, size_t length, void *context);
+  bool (*equal)(
+    const char *key1,
+    size_t length1,
+    const char *key2,
+    size_t length2,
+    void *context
+  );
+  void *context;
+};
+
+#if defined(RASH_THREADS)
+
+/*
+ * The work done by one thread of a parallel build.
+*/
+struct hash_table_build_worker {
+
+  struct hash_table *table;
+  const struct hash_table_pair *pairs;
+
+  // The keys of every pair. The worker hashes the ones from hash_start
+  // up to hash_end.
+  struct hash_table_key *keys;
+  size_t hash_start;
+  size_t hash_end;
+
+  // Indices of the pairs whose desired position is in the range of
+  // buckets filled by the worker (in the order they were given).
+  size_t *indices;
+  size_t count;
+
+  // The range of buckets filled by the worker. Nothing past the end is
+  // read or written, as it belongs to the next worker.
+  size_t start;
+  size_t end;
+
+  // Where the keys copied by the worker are stored, which is merged
+  // into the arena of the table once every worker has finished.
+  struct rash_arena arena;
+
+  // Entries which could not be placed without going past the end of
+  // the range (or over the maximum probe count). These are inserted by
+  // a single thread once every worker has finished.
+  struct hash_table_entry *deferred;
+  size_t deferred_count;
+  size_t deferred_capacity;
+
+  // Number of entries placed (not counting ones which replaced an
+  // entry with the same key).
+  size_t added;
+
+  // Whether the worker ran out of memory, and stopped.
+  bool failed;
+
+  // The thread running the worker, if one was started for it.
+  pthread_t thread;
+  bool started;
 };
 
+#endif
+
 /*
  * Takes a hash (generated from some other hash function) and
  * ensures that all hashes past are equally distributed over a
@@ -132,9 +546,45 @@ struct hash_table {
 static size_t fibonacci_hash(size_t hash, int bits);
 
 /*
- * Hashing algorithm for a string.
+ * Hash a key (of a given length, excluding the terminator). Unless the
+ * table has its own hash function, the hash function is picked at
+ * runtime depending on the CPU (see rash_hash.h).
+*/
+static size_t hash_table_hash_key(
+  const struct hash_table *table,
+  const char *key,
+  size_t length
+);
+
+/*
+ * Generate a random seed for a table.
+*/
+static uint64_t hash_table_random_seed(const struct hash_table *table);
+
+/*
+ * Determines if the table should be reseeded, rather than resized, after
+ * the maximum probe count has been exceeded inserting a key with the
+ * given desired position.
+*/
+static bool hash_table_should_reseed(
+  const struct hash_table *table,
+  size_t position
+);
+
+/*
+ * Rehash every entry in the table using a new seed.
+*/
+static bool hash_table_reseed(struct hash_table *table);
+
+/*
+ * Create the key (of a given length, excluding any terminator) used to
+ * look up a value, hashing it.
 */
-static size_t djb2_hash(const char *str);
+static struct hash_table_key hash_table_key_create(
+  const struct hash_table *table,
+  const char *key,
+  size_t length
+);
 
 /* Takes the values modified by HASH_TABLE_ITERATE_TO_NEXT
  * and checks if position is pointing to a valid position.
@@ -145,21 +595,196 @@ static bool hash_table_is_next_found(
 );
 
 /*
- * Applies fibonacci_hash and djb2_hash at the
- * same time.
+ * Get the fragment of a hash that is stored in the tag
+ * array.
+*/
+static uint8_t hash_table_get_tag(size_t hash);
+
+/*
+ * Applies fibonacci_hash to a hash to get the desired
+ * position in the table.
 */
 static size_t hash_table_get_position(
   const struct hash_table *table,
-  const char *key
+  size_t hash
 );
 
 /*
- * Compares the dist_from_des property to determine
- * if entry1 should replace entry2.
+ * Determine if an entry has the given key. The stored hash is compared
+ * first so that the keys themselves are only compared (with the
+ * table's equality function, if it has one) if the hashes match.
 */
-static bool hash_table_should_replace_entry(
-  const struct hash_table_entry *entry1,
-  const struct hash_table_entry *entry2
+static bool hash_table_entry_matches(
+  const struct hash_table *table,
+  const struct hash_table_entry *entry,
+  const struct hash_table_key *key
+);
+
+/*
+ * Find the position of the entry with the given key. Returns false
+ * if the key is not in the table.
+*/
+static bool hash_table_find(
+  const struct hash_table *table,
+  const struct hash_table_key *key,
+  size_t *position
+);
+
+/*
+ * Start loading the buckets at the desired position of a key into the
+ * cache.
+*/
+static void hash_table_prefetch(
+  const struct hash_table *table,
+  const struct hash_table_key *key
+);
+
+/*
+ * Get the entry with a key (which has already been hashed), looking in
+ * the old table as well. Returns NULL if the key is not in the table.
+*/
+static struct hash_table_entry *hash_table_find_entry(
+  const struct hash_table *table,
+  const struct hash_table_key *key
+);
+
+/*
+ * Get the data associated with a key (which has already been hashed),
+ * or NULL if the key is not in the table.
+*/
+static void *hash_table_get_key(
+  const struct hash_table *table,
+  const struct hash_table_key *key
+);
+
+/*
+ * Add data associated with a key (owned by a given owner), replacing
+ * the data of the key if it is already in the table (see
+ * hash_table_replace).
+*/
+static bool hash_table_add_with_owner(
+  struct hash_table *table,
+  const char *key,
+  size_t length,
+  void *data,
+  void **previous,
+  enum hash_table_key_owner owner
+);
+
+/*
+ * Add data associated with a key which is not in the table (hashed
+ * with the current seed), growing the table if it needs to. The hash
+ * of the key is updated if the table is reseeded first.
+*/
+static bool hash_table_add_missing(
+  struct hash_table *table,
+  struct hash_table_key *key,
+  void *data,
+  enum hash_table_key_owner owner
+);
+
+/*
+ * Add data associated with a key (which has already been hashed with
+ * the current seed), once the table has been made ready for it. Unless
+ * the key is copied, the table only takes the key if this succeeds.
+*/
+static bool hash_table_add_key(
+  struct hash_table *table,
+  const struct hash_table_key *key,
+  void *data,
+  enum hash_table_key_owner owner
+);
+
+/*
+ * Insert an entry which has already been created (with a hash from the
+ * current seed), once the table has been made ready for it.
+*/
+static bool hash_table_add_entry(
+  struct hash_table *table,
+  struct hash_table_entry entry
+);
+
+#if defined(RASH_THREADS)
+
+/*
+ * Add pairs to an empty table which has already been made big enough
+ * for them, using a number of threads (see hash_table_add_parallel).
+*/
+static bool hash_table_build_parallel(
+  struct hash_table *table,
+  const struct hash_table_pair *pairs,
+  size_t n,
+  size_t threads
+);
+
+/*
+ * Run a function for every worker, each on its own thread (apart from
+ * the first, which is run on this one), and wait for them all to
+ * finish.
+*/
+static void hash_table_build_run(
+  struct hash_table_build_worker *workers,
+  size_t count,
+  void *(*work)(void *)
+);
+
+/*
+ * Hash the keys of the pairs given to a worker (passed as a void
+ * pointer so it can be run on a thread).
+*/
+static void *hash_table_build_hash(void *argument);
+
+/*
+ * Create entries for the pairs given to a worker and place them in its
+ * range of buckets (passed as a void pointer so it can be run on a
+ * thread).
+*/
+static void *hash_table_build_fill(void *argument);
+
+/*
+ * Place an entry in the range of buckets of a worker, or leave it (or
+ * an entry it displaces) for later if that would mean going past the
+ * end of the range. Returns false if there is no memory, in which case
+ * the entry (or the one it displaced) is lost.
+*/
+static bool hash_table_build_place(
+  struct hash_table_build_worker *worker,
+  struct hash_table_entry entry
+);
+
+/*
+ * Keep an entry for later. Returns false if there is no memory.
+*/
+static bool hash_table_build_defer(
+  struct hash_table_build_worker *worker,
+  const struct hash_table_entry *entry
+);
+
+/*
+ * Free the memory owned by an entry created by a worker.
+*/
+static void hash_table_build_entry_free(
+  struct hash_table_build_worker *worker,
+  struct hash_table_entry *entry
+);
+
+#endif
+
+/*
+ * Compares the distances from the desired position to determine
+ * if the entry with dist1 should replace the entry with dist2.
+*/
+static bool hash_table_should_replace_entry(uint8_t dist1, uint8_t dist2);
+
+/*
+ * Swap the entry (and its distance) held by the caller with the one
+ * in the bucket at the given position.
+*/
+static void hash_table_swap_entry(
+  struct hash_table_buckets *buckets,
+  size_t position,
+  struct hash_table_entry *entry,
+  uint8_t *dist
 );
 
 /*
@@ -178,8 +803,9 @@ static bool hash_table_remove_from_position(
 */
 static void hash_table_unwind_insertion_changes(
   struct hash_table *table,
-  struct hash_table_entry *inserted,
-  struct hash_table_entry *original,
+  const struct hash_table_entry *inserted,
+  struct hash_table_entry poor,
+  uint8_t poor_dist,
   size_t unwind_start_position
 );
 
@@ -188,15 +814,32 @@ static void hash_table_unwind_insertion_changes(
 */
 static bool hash_table_insert(
   struct hash_table *table,
-  struct hash_table_entry *entry
+  struct hash_table_entry entry
 );
 
 /*
- * Rehash all the elements in the hash table.
+ * Rehash all the elements in the hash table. The old seed is the seed
+ * used to hash the entries in the old buckets. If it is not the seed
+ * of the table then the entries are hashed again.
 */
 static void hash_table_rehash(
   struct hash_table *table,
-  struct hash_table_entry **old_buckets,
+  const struct hash_table_buckets *old_buckets,
+  size_t old_max_size,
+  uint8_t old_max_size_shift,
+  uint64_t old_seed
+);
+
+/*
+ * Move all the elements from the old buckets into the (empty) buckets
+ * of the table, which has the same seed but a different size. Entries
+ * stay in the same order, so they are placed directly, in a single
+ * pass. Returns false (leaving the table empty) if an entry would be
+ * further from its desired position than the maximum probe count.
+*/
+static bool hash_table_migrate(
+  struct hash_table *table,
+  const struct hash_table_buckets *old_buckets,
   size_t old_max_size,
   uint8_t old_max_size_shift
 );
@@ -208,63 +851,314 @@ static void hash_table_rehash(
 static bool hash_table_resize(struct hash_table *table, int shift_amount);
 
 /*
- * Free a hash table entry.
+ * Grow the table by one step, incrementally if the table was created
+ * to do so.
 */
-static void hash_table_entry_free(struct hash_table_entry *entry);
+static bool hash_table_grow(struct hash_table *table);
 
 /*
- * Allocate the memory used for buckets.
+ * Start growing the table by a given shift amount, leaving the entries
+ * in the current buckets to be moved across bit by bit (by
+ * hash_table_migrate_step). The table must not already be growing
+ * incrementally.
 */
-static struct hash_table_entry **hash_table_buckets_alloc(
-  struct hash_table *table
+static bool hash_table_resize_incremental(
+  struct hash_table *table,
+  int shift_amount
 );
 
 /*
- * Create a hash table entry.
+ * Move entries from the old table into the current buckets, looking at
+ * no more than the given number of buckets (and entries). The old table
+ * is freed once it is empty.
 */
-static struct hash_table_entry *hash_table_entry_create(
-  const char *key,
-  void *data
-);
+static bool hash_table_migrate_step(struct hash_table *table, size_t count);
 
 /*
- * Determines if the hash table should be resized up (based
- * on the resize factor).
+ * Free the memory owned by a hash table entry (the entry itself
+ * lives in the bucket array).
 */
-static bool hash_table_should_resize_up_factor(
-  const struct hash_table *table
+static void hash_table_entry_free(
+  struct hash_table *table,
+  struct hash_table_entry *entry
 );
 
 /*
- * Determines if the hash table should be resized down (based
- * on the resize factor).
+ * Free every entry in the buckets of a table, or of its old table
+ * (in which case the owner is the old table), passing the data of
+ * each to a callback (if not NULL).
 */
-static bool hash_table_should_resize_down_factor(
-  const struct hash_table *table
+static void hash_table_entries_free(
+  struct hash_table *table,
+  struct hash_table *owner,
+  void (*cb)(void *)
 );
 
-// Taken from:
-// https://probablydance.com/2018/06/16/fibonacci-hashing-the-optimization-
-// that-the-world-forgot-or-a-better-alternative-to-integer-modulo/
-static size_t fibonacci_hash(size_t hash, int bits) {
+/*
+ * The allocator used by tables which are not given one.
+*/
+static void *hash_table_default_alloc(size_t size, void *context);
+static void hash_table_default_free(void *memory, size_t size, void *context);
+
+/*
+ * Allocate memory of a given size, which is set to zero.
+*/
+static void *hash_table_alloc_zeroed(
+  const struct hash_table *table,
+  size_t size
+);
+
+#if defined(HASH_TABLE_MMAP)
+/*
+ * Round a size up to a whole number of huge pages.
+*/
+static size_t hash_table_round_huge(size_t size);
+#endif
+
+/*
+ * Map zeroed memory of a given size (rounded up to a whole number of
+ * huge pages), backed by huge pages if the system can provide them.
+ * Returns NULL if the memory can not be mapped.
+*/
+static void *hash_table_map_huge(size_t size);
+
+/*
+ * Unmap memory returned by hash_table_map_huge.
+*/
+static void hash_table_unmap_huge(void *memory, size_t size);
+
+/*
+ * Allocate the memory used for buckets.
+*/
+static bool hash_table_buckets_alloc(
+  const struct hash_table *table,
+  struct hash_table_buckets *buckets
+);
+
+/*
+ * Free the memory used for buckets.
+*/
+static void hash_table_buckets_free(
+  const struct hash_table *table,
+  struct hash_table_buckets *buckets
+);
+
+/*
+ * Determine if a key of a given length (excluding the terminator) is
+ * stored inside its entry.
+*/
+static bool hash_table_key_is_inline(size_t length);
+
+/*
+ * Get the key of an entry, wherever it is stored. Inline keys are only
+ * valid for as long as the entry stays where it is.
+*/
+static const char *hash_table_entry_get_key_value(
+  const struct hash_table_entry *entry
+);
+
+/*
+ * Get and set the pointer to the copy of a key which is not stored
+ * inline.
+*/
+static char *hash_table_entry_get_key_pointer(
+  const struct hash_table_entry *entry
+);
+
+static void hash_table_entry_set_key_pointer(
+  struct hash_table_entry *entry,
+  char *pointer
+);
+
+/*
+ * Get and set who owns a key which is not stored inline.
+*/
+static enum hash_table_key_owner hash_table_entry_get_key_owner(
+  const struct hash_table_entry *entry
+);
+
+static void hash_table_entry_set_key_owner(
+  struct hash_table_entry *entry,
+  enum hash_table_key_owner owner
+);
+
+/*
+ * Determine if two entries are the same entry (rather than just
+ * having equal keys).
+*/
+static bool hash_table_entry_is_same(
+  const struct hash_table_entry *entry1,
+  const struct hash_table_entry *entry2
+);
+
+/*
+ * Initialise a hash table entry, copying the key only if it is stored
+ * inline. Returns false if the key is too long to be stored at all.
+*/
+static bool hash_table_entry_init(
+  struct hash_table_entry *entry,
+  const struct hash_table_key *key,
+  void *data
+);
+
+/*
+ * Initialise a hash table entry, making a copy of the key (unless it
+ * is stored inline).
+*/
+static bool hash_table_entry_create(
+  struct hash_table *table,
+  struct hash_table_entry *entry,
+  const struct hash_table_key *key,
+  void *data
+);
+
+/*
+ * Determines if the keys of a table should be compacted.
+*/
+static bool hash_table_should_compact_keys(const struct hash_table *table);
+
+/*
+ * Copy the keys of every entry (in the table and its old table) that
+ * are still in use into a new arena, freeing the old one. Must not be
+ * called while an entry is being inserted (as it would be left
+ * pointing at the old arena). Nothing happens if there is not enough
+ * memory.
+*/
+static void hash_table_compact_keys(struct hash_table *table);
+
+/*
+ * Get a shared copy of a key from an interner (copying it if the
+ * interner doesn't have it already). Returns NULL if there is no
+ * memory.
+*/
+static char *hash_table_interner_acquire(
+  struct hash_table_interner *interner,
+  const struct hash_table_key *key
+);
+
+/*
+ * Give back a shared copy of a key, freeing it if nothing else is
+ * using it.
+*/
+static void hash_table_interner_release(
+  struct hash_table_interner *interner,
+  const char *key,
+  size_t length
+);
+
+/*
+ * Get the key of an entry, in the form used for lookups.
+*/
+static struct hash_table_key hash_table_entry_get_key(
+  const struct hash_table_entry *entry
+);
+
+/*
+ * Work out the shift needed for the table to hold a given number of
+ * elements without going over the load factor. Returns zero if the
+ * table could never be that big.
+*/
+static uint8_t hash_table_get_shift_for_capacity(size_t capacity);
+
+/*
+ * Determines if the hash table should be resized up (based
+ * on the resize factor).
+*/
+static bool hash_table_should_resize_up_factor(
+  const struct hash_table *table
+);
+
+/*
+ * Determines if the hash table should be resized down (based
+ * on the resize factor).
+*/
+static bool hash_table_should_resize_down_factor(
+  const struct hash_table *table
+);
+
+// Taken from:
+// https://probablydance.com/2018/06/16/fibonacci-hashing-the-optimization-
+// that-the-world-forgot-or-a-better-alternative-to-integer-modulo/
+static size_t fibonacci_hash(size_t hash, int bits) {
   int shift_amount = (sizeof(size_t) * 8) - bits;
   return (hash * FIBONACCI_MULTIPLIER) >> shift_amount;
 }
 
-// Taken from:
-// http://www.cse.yorku.ca/~oz/hash.html
-// Magic numbers are part of the algorithm and represent nothing
-// specifically.
-static size_t djb2_hash(const char *str) {
+static size_t hash_table_hash_key(
+  const struct hash_table *table,
+  const char *key,
+  size_t length
+) {
+
+  if (table->hash) {
+    return table->hash(key, length, table->context);
+  }
+
+  // On 32 bit systems the bottom half of the hash is used.
+  return (size_t) table->builtin_hash(key, length, table->seed);
+}
+
+static uint64_t hash_table_random_seed(const struct hash_table *table) {
+
+  // There is no portable source of randomness in C99, so mix together
+  // values which differ between processes (the addresses, when address
+  // space layout randomisation is used) and between tables. Nothing is
+  // shared between calls, so tables can be created on any thread.
+  uint64_t values[4];
+  values[0] = (uint64_t) time(NULL);
+  values[1] = (uint64_t) clock();
+  values[2] = (uint64_t) (uintptr_t) table;
+  values[3] = (uint64_t) (uintptr_t) values;
+
+  return rash_hash_wy(values, sizeof(values), table->seed);
+}
+
+static bool hash_table_should_reseed(
+  const struct hash_table *table,
+  size_t position
+) {
+
+  // A table with its own hash function does not use the seed, and
+  // the entries of an old table have to keep theirs.
+  if (table->hash || table->old) {
+    return false;
+  }
+
+  if (
+    table->max_size_shift < HASH_TABLE_RESEED_MIN_SHIFT ||
+    table->reseed_count >= HASH_TABLE_MAX_RESEEDS ||
+    table->curr_size >= table->max_size * HASH_TABLE_LOAD_FACTOR_RESEED
+  ) {
+    return false;
+  }
 
-  size_t hash = 5381;
-  int c;
+  // Long runs happen naturally from time to time, but they are made up
+  // of keys that want many different positions. Keys that collide want
+  // the same one, so count how many in the run want our position.
+  uint8_t same_position = 0;
 
-  while ((c = *str++)) {
-    hash = ((hash << 5) + hash) + c;
+  for (uint8_t i = 0; i < table->max_size_shift; i++) {
+    if (table->buckets.dists[position + i] == i + 1) {
+      same_position++;
+    }
   }
 
-  return hash;
+  return same_position >= table->max_size_shift / 2;
+}
+
+static struct hash_table_key hash_table_key_create(
+  const struct hash_table *table,
+  const char *key,
+  size_t length
+) {
+
+  struct hash_table_key result;
+
+  result.value = key;
+  result.length = length;
+  result.hash = hash_table_hash_key(table, key, result.length);
+
+  return result;
 }
 
 static bool hash_table_is_next_found(
@@ -278,417 +1172,2292 @@ static bool hash_table_is_next_found(
   return probe_count < table->max_size_shift;
 }
 
+static uint8_t hash_table_get_tag(size_t hash) {
+
+  // The top bits are used by fibonacci_hash to pick the position,
+  // so use the bottom bits here.
+  return (uint8_t) hash;
+}
+
 static size_t hash_table_get_position(
   const struct hash_table *table,
-  const char *key
+  size_t hash
 ) {
-  return fibonacci_hash(djb2_hash(key), table->max_size_shift);
+  return fibonacci_hash(hash, table->max_size_shift);
 }
 
-static bool hash_table_should_replace_entry(
-  const struct hash_table_entry *entry1,
-  const struct hash_table_entry *entry2
+static bool hash_table_entry_matches(
+  const struct hash_table *table,
+  const struct hash_table_entry *entry,
+  const struct hash_table_key *key
 ) {
-  return entry1->dist_from_des > entry2->dist_from_des;
+
+  if (entry->hash != key->hash) {
+    return false;
+  }
+
+  // The built in comparison is done inline, so that tables which
+  // use it never make an indirect call.
+  if (!table->equal) {
+    return entry->key_length == key->length &&
+      memcmp(
+        hash_table_entry_get_key_value(entry),
+        key->value,
+        key->length
+      ) == 0;
+  }
+
+  return table->equal(
+    hash_table_entry_get_key_value(entry),
+    entry->key_length,
+    key->value,
+    key->length,
+    table->context
+  );
 }
 
-static bool hash_table_remove_from_position(
+#ifdef HASH_TABLE_SIMD
+
+/*
+ * Index of the lowest set bit in a (non-zero) mask.
+*/
+static unsigned int hash_table_lowest_bit(uint32_t mask) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+static bool hash_table_find(
+  const struct hash_table *table,
+  const struct hash_table_key *key,
+  size_t *position
+) {
+
+  const struct hash_table_buckets *buckets = &table->buckets;
+  size_t start = hash_table_get_position(table, key->hash);
+  uint8_t key_tag = hash_table_get_tag(key->hash);
+
+  // Most keys are found in their desired position, in which case
+  // checking the first bucket on its own is cheaper than loading
+  // a whole group (which may straddle two cache lines).
+  if (
+    buckets->dists[start] == 1 &&
+    buckets->tags[start] == key_tag &&
+    hash_table_entry_matches(table, &buckets->entries[start], key)
+  ) {
+    *position = start;
+    return true;
+  }
+
+  hash_table_group tag = HASH_TABLE_GROUP_SET(key_tag);
+
+  // The distances (plus one) that an entry with the same desired
+  // position as the key would have in each bucket of the group.
+  hash_table_group dists = HASH_TABLE_GROUP_OFFSETS();
+  hash_table_group step = HASH_TABLE_GROUP_SET(HASH_TABLE_GROUP_SIZE);
+
+  for (
+    uint8_t probe_count = 0;
+    probe_count < table->max_size_shift;
+    probe_count += HASH_TABLE_GROUP_SIZE
+  ) {
+
+    hash_table_group group_dists =
+      HASH_TABLE_GROUP_LOAD(buckets->dists + start + probe_count);
+    hash_table_group group_tags =
+      HASH_TABLE_GROUP_LOAD(buckets->tags + start + probe_count);
+
+    // A bucket can only hold the key if its entry wants the same
+    // position as the key and the tags match.
+    uint32_t matches = HASH_TABLE_GROUP_MASK(
+      HASH_TABLE_GROUP_AND(
+        HASH_TABLE_GROUP_EQ(group_dists, dists),
+        HASH_TABLE_GROUP_EQ(group_tags, tag)
+      )
+    );
+
+    // Probing stops at the first bucket which is empty or whose entry
+    // is closer to its desired position than the key would be (see
+    // HASH_TABLE_ITERATE_CANDIDATES). Distances never get close to
+    // 128, so the signed comparison is fine.
+    uint32_t stops = HASH_TABLE_GROUP_MASK(
+      HASH_TABLE_GROUP_LT(group_dists, dists)
+    );
+
+    // Never look past the maximum probe count.
+    if (table->max_size_shift - probe_count < HASH_TABLE_GROUP_SIZE) {
+      stops |= ~(uint32_t) 0 << (table->max_size_shift - probe_count);
+    }
+
+    // Ignore any matches after the point at which we stop.
+    if (stops) {
+      matches &= (stops & (~stops + 1)) - 1;
+    }
+
+    while (matches) {
+
+      size_t candidate = start + probe_count + hash_table_lowest_bit(matches);
+
+      if (hash_table_entry_matches(table, &buckets->entries[candidate], key)) {
+        *position = candidate;
+        return true;
+      }
+
+      // Clear the lowest bit.
+      matches &= matches - 1;
+    }
+
+    if (stops) {
+      return false;
+    }
+
+    dists = HASH_TABLE_GROUP_ADD(dists, step);
+  }
+
+  return false;
+}
+
+#else
+
+static bool hash_table_find(
+  const struct hash_table *table,
+  const struct hash_table_key *key,
+  size_t *position
+) {
+
+  const struct hash_table_buckets *buckets = &table->buckets;
+
+  uint8_t probe_count = 0;
+  uint8_t tag = hash_table_get_tag(key->hash);
+  size_t current = hash_table_get_position(table, key->hash);
+
+  HASH_TABLE_ITERATE_CANDIDATES(table, current, probe_count) {
+
+    // Only an entry which wants the same position as the key
+    // can have the same key.
+    if (
+      buckets->dists[current] == probe_count + 1 &&
+      buckets->tags[current] == tag &&
+      hash_table_entry_matches(table, &buckets->entries[current], key)
+    ) {
+      *position = current;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#endif
+
+static void hash_table_prefetch(
+  const struct hash_table *table,
+  const struct hash_table_key *key
+) {
+
+  size_t position = hash_table_get_position(table, key->hash);
+
+  // The old table (if there is one) is not prefetched, as most keys
+  // are found before it is looked at.
+  HASH_TABLE_PREFETCH(table->buckets.dists + position);
+  HASH_TABLE_PREFETCH(table->buckets.tags + position);
+  HASH_TABLE_PREFETCH(table->buckets.entries + position);
+}
+
+static struct hash_table_entry *hash_table_find_entry(
+  const struct hash_table *table,
+  const struct hash_table_key *key
+) {
+
+  size_t position;
+
+  if (hash_table_find(table, key, &position)) {
+    return &table->buckets.entries[position];
+  }
+
+  // The table can't be changed here, so lookups never move entries
+  // out of the old table (adds and removes do).
+  if (table->old && hash_table_find(table->old, key, &position)) {
+    return &table->old->buckets.entries[position];
+  }
+
+  return NULL;
+}
+
+static void *hash_table_get_key(
+  const struct hash_table *table,
+  const struct hash_table_key *key
+) {
+
+  struct hash_table_entry *entry = hash_table_find_entry(table, key);
+
+  return entry ? entry->data : NULL;
+}
+
+static bool hash_table_add_with_owner(
   struct hash_table *table,
-  size_t position
+  const char *key,
+  size_t length,
+  void *data,
+  void **previous,
+  enum hash_table_key_owner owner
 ) {
 
-  // Set the current position to NULL (note that the caller
-  // must have dealt with freeing memory).
-  table->buckets[position] = NULL;
+  struct hash_table_key lookup = hash_table_key_create(table, key, length);
 
-  position++;
+  // Replacing the data of an existing key leaves the entry (and its
+  // key) where it is.
+  struct hash_table_entry *entry = hash_table_find_entry(table, &lookup);
+
+  if (entry) {
+    if (previous) {
+      *previous = entry->data;
+    }
+
+    entry->data = data;
+
+    // The new key isn't needed.
+    if (owner == HASH_TABLE_KEY_OWNED) {
+      table->allocator.free(
+        (char *) key,
+        lookup.length + 1,
+        table->allocator.context
+      );
+    }
+
+    return true;
+  }
+
+  if (previous) {
+    *previous = NULL;
+  }
+
+  return hash_table_add_missing(table, &lookup, data, owner);
+}
+
+static bool hash_table_add_missing(
+  struct hash_table *table,
+  struct hash_table_key *key,
+  void *data,
+  enum hash_table_key_owner owner
+) {
+
+  uint64_t seed = table->seed;
+
+  if (hash_table_should_resize_up_factor(table)) {
+    if (!hash_table_grow(table)) {
+      return false;
+    }
+  }
+
+  if (!hash_table_migrate_step(table, HASH_TABLE_MIGRATE_STEP)) {
+    return false;
+  }
+
+  // Done before the new entry is created, so that its key doesn't
+  // need to be moved.
+  if (hash_table_should_compact_keys(table)) {
+    hash_table_compact_keys(table);
+  }
+
+  // Growing can reseed the table.
+  if (table->seed != seed) {
+    key->hash = hash_table_hash_key(table, key->value, key->length);
+  }
+
+  // Don't bother undoing a resize if we failed to add an entry - it
+  // will probably just cause more problems!
+  return hash_table_add_key(table, key, data, owner);
+}
+
+static bool hash_table_add_key(
+  struct hash_table *table,
+  const struct hash_table_key *key,
+  void *data,
+  enum hash_table_key_owner owner
+) {
+
+  struct hash_table_entry new_entry;
+
+  if (owner == HASH_TABLE_KEY_COPIED) {
+    if (!hash_table_entry_create(table, &new_entry, key, data)) {
+      return false;
+    }
+
+  } else {
+
+    // Short keys are still copied into the entry.
+    if (!hash_table_entry_init(&new_entry, key, data)) {
+      return false;
+    }
+
+    if (!hash_table_key_is_inline(key->length)) {
+      hash_table_entry_set_key_pointer(&new_entry, (char *) key->value);
+      hash_table_entry_set_key_owner(&new_entry, owner);
+    }
+  }
+
+  if (!hash_table_add_entry(table, new_entry)) {
+
+    // Keys which weren't copied still belong to the caller.
+    if (owner == HASH_TABLE_KEY_COPIED) {
+      hash_table_entry_free(table, &new_entry);
+    }
+
+    return false;
+  }
+
+  // An owned key which was copied into the entry isn't needed.
+  if (
+    owner == HASH_TABLE_KEY_OWNED &&
+    hash_table_key_is_inline(key->length)
+  ) {
+    table->allocator.free(
+      (char *) key->value,
+      key->length + 1,
+      table->allocator.context
+    );
+  }
+
+  return true;
+}
+
+static bool hash_table_add_entry(
+  struct hash_table *table,
+  struct hash_table_entry entry
+) {
+
+  struct hash_table_key key = hash_table_entry_get_key(&entry);
+
+  if (!hash_table_insert(table, entry)) {
+    return false;
+  }
+
+  // The key may still be in the old table, in which case the new entry
+  // replaces it. Tables are never reseeded while they have an old
+  // table, so the hash is still right.
+  size_t position;
+  if (table->old && hash_table_find(table->old, &key, &position)) {
+    hash_table_entry_free(table, &table->old->buckets.entries[position]);
+    hash_table_remove_from_position(table->old, position);
+  }
+
+  return true;
+}
+
+#if defined(RASH_THREADS)
+
+static bool hash_table_build_parallel(
+  struct hash_table *table,
+  const struct hash_table_pair *pairs,
+  size_t n,
+  size_t threads
+) {
+
+  const struct hash_table_allocator *allocator = &table->allocator;
+
+  bool result = false;
+
+  struct hash_table_key *keys = NULL;
+  size_t *indices = NULL;
+  struct hash_table_build_worker *workers = NULL;
+
+  if (n > SIZE_MAX / sizeof(*keys)) {
+    goto error_alloc;
+  }
+
+  keys = allocator->alloc(n * sizeof(*keys), allocator->context);
+  indices = allocator->alloc(n * sizeof(*indices), allocator->context);
+  workers = allocator->alloc(threads * sizeof(*workers), allocator->context);
+
+  if (!keys || !indices || !workers) {
+    goto error_alloc;
+  }
+
+  memset(workers, 0, threads * sizeof(*workers));
+
+  // Every worker gets the same number of buckets, apart from the last
+  // one, which also gets the buckets past max_size.
+  size_t width = (table->max_size + threads - 1) / threads;
+
+  for (size_t i = 0; i < threads; i++) {
+
+    struct hash_table_build_worker *worker = &workers[i];
+
+    worker->table = table;
+    worker->pairs = pairs;
+    worker->keys = keys;
+    worker->hash_start = n / threads * i;
+    worker->hash_end = i == threads - 1 ? n : n / threads * (i + 1);
+    worker->start = width * i;
+    worker->end = i == threads - 1 ?
+      table->max_size + table->max_size_shift :
+      width * (i + 1);
+
+    rash_arena_init(&worker->arena, allocator);
+  }
+
+  hash_table_build_run(workers, threads, hash_table_build_hash);
+
+  // Hand each pair to the worker whose range holds its desired
+  // position, keeping them in order (so that if a key is given twice,
+  // the same worker sees both).
+  for (size_t i = 0; i < n; i++) {
+    workers[hash_table_get_position(table, keys[i].hash) / width].count++;
+  }
+
+  size_t offset = 0;
+
+  for (size_t i = 0; i < threads; i++) {
+    workers[i].indices = indices + offset;
+    offset += workers[i].count;
+    workers[i].count = 0;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    struct hash_table_build_worker *worker =
+      &workers[hash_table_get_position(table, keys[i].hash) / width];
+    worker->indices[worker->count++] = i;
+  }
+
+  hash_table_build_run(workers, threads, hash_table_build_fill);
+
+  result = true;
+
+  for (size_t i = 0; i < threads; i++) {
+    rash_arena_merge(&table->arena, &workers[i].arena);
+    table->curr_size += workers[i].added;
+
+    if (workers[i].failed) {
+      result = false;
+    }
+  }
+
+  // The entries left for later can go anywhere, so they are inserted
+  // in the usual way (which may grow or reseed the table).
+  for (size_t i = 0; i < threads; i++) {
+
+    struct hash_table_build_worker *worker = &workers[i];
+
+    for (size_t j = 0; j < worker->deferred_count; j++) {
+
+      struct hash_table_entry *entry = &worker->deferred[j];
+
+      if (
+        !result ||
+        !hash_table_migrate_step(table, HASH_TABLE_MIGRATE_STEP) ||
+        !hash_table_add_entry(table, *entry)
+      ) {
+        hash_table_entry_free(table, entry);
+        result = false;
+      }
+    }
+
+    if (worker->deferred) {
+      allocator->free(
+        worker->deferred,
+        worker->deferred_capacity * sizeof(*worker->deferred),
+        allocator->context
+      );
+    }
+  }
+
+error_alloc:
+  if (workers) {
+    allocator->free(workers, threads * sizeof(*workers), allocator->context);
+  }
+
+  if (indices) {
+    allocator->free(indices, n * sizeof(*indices), allocator->context);
+  }
+
+  if (keys) {
+    allocator->free(keys, n * sizeof(*keys), allocator->context);
+  }
+
+  return result;
+}
+
+static void hash_table_build_run(
+  struct hash_table_build_worker *workers,
+  size_t count,
+  void *(*work)(void *)
+) {
+
+  for (size_t i = 1; i < count; i++) {
+
+    workers[i].started =
+      pthread_create(&workers[i].thread, NULL, work, &workers[i]) == 0;
+
+    // Do the work on this thread if another one can't be started.
+    if (!workers[i].started) {
+      work(&workers[i]);
+    }
+  }
+
+  work(&workers[0]);
+
+  for (size_t i = 1; i < count; i++) {
+    if (workers[i].started) {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+}
+
+static void *hash_table_build_hash(void *argument) {
+
+  struct hash_table_build_worker *worker = argument;
+
+  for (size_t i = worker->hash_start; i < worker->hash_end; i++) {
+    const char *key = worker->pairs[i].key;
+    worker->keys[i] = hash_table_key_create(worker->table, key, strlen(key));
+  }
+
+  return NULL;
+}
+
+static void *hash_table_build_fill(void *argument) {
+
+  struct hash_table_build_worker *worker = argument;
+
+  for (size_t i = 0; i < worker->count; i++) {
+
+    size_t index = worker->indices[i];
+    const struct hash_table_key *key = &worker->keys[index];
+
+    struct hash_table_entry entry;
+    if (!hash_table_entry_init(&entry, key, worker->pairs[index].data)) {
+      worker->failed = true;
+      break;
+    }
+
+    // The arena of the table can't be shared between threads, so the
+    // worker copies the keys into its own.
+    if (!hash_table_key_is_inline(key->length)) {
+
+      char *copy = rash_arena_alloc(&worker->arena, key->length + 1);
+
+      if (!copy) {
+        worker->failed = true;
+        break;
+      }
+
+      memcpy(copy, key->value, key->length + 1);
+      hash_table_entry_set_key_pointer(&entry, copy);
+    }
+
+    if (!hash_table_build_place(worker, entry)) {
+      worker->failed = true;
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static bool hash_table_build_place(
+  struct hash_table_build_worker *worker,
+  struct hash_table_entry entry
+) {
+
+  const struct hash_table *table = worker->table;
+  struct hash_table_buckets *buckets = &worker->table->buckets;
+
+  struct hash_table_key key = hash_table_entry_get_key(&entry);
+  uint8_t tag = hash_table_get_tag(entry.hash);
+  size_t position = hash_table_get_position(table, entry.hash);
+
+  struct hash_table_entry rich = entry;
+  uint8_t rich_dist = 1;
+
+  // Whether the new entry has been put in a bucket, and the one being
+  // carried along is an entry it displaced.
+  bool swapped = false;
+
+  for (
+    ;
+    rich_dist <= table->max_size_shift && position < worker->end;
+    position++, rich_dist++
+  ) {
+
+    uint8_t dist = buckets->dists[position];
+
+    if (!dist) {
+      hash_table_swap_entry(buckets, position, &rich, &rich_dist);
+      worker->added++;
+      return true;
+    }
+
+    // The same as hash_table_insert, an entry with the same key is
+    // always found before the new entry displaces any others.
+    if (
+      !swapped &&
+      dist == rich_dist &&
+      buckets->tags[position] == tag &&
+      hash_table_entry_matches(table, &buckets->entries[position], &key)
+    ) {
+      hash_table_build_entry_free(worker, &buckets->entries[position]);
+      hash_table_swap_entry(buckets, position, &rich, &rich_dist);
+      return true;
+    }
+
+    if (hash_table_should_replace_entry(rich_dist, dist)) {
+      hash_table_swap_entry(buckets, position, &rich, &rich_dist);
+      swapped = true;
+    }
+  }
+
+  // If the new entry displaced another, the displaced one is taken out
+  // of the table instead (so the number of entries in the range doesn't
+  // change). That only leaves the entries after it further from their
+  // desired positions than they need to be, which lookups cope with.
+  if (!hash_table_build_defer(worker, &rich)) {
+    hash_table_build_entry_free(worker, &rich);
+    return false;
+  }
+
+  return true;
+}
+
+static bool hash_table_build_defer(
+  struct hash_table_build_worker *worker,
+  const struct hash_table_entry *entry
+) {
+
+  if (worker->deferred_count == worker->deferred_capacity) {
+
+    const struct hash_table_allocator *allocator = &worker->table->allocator;
+
+    size_t capacity = worker->deferred_capacity ?
+      worker->deferred_capacity * 2 :
+      HASH_TABLE_BUILD_MIN_DEFERRED;
+
+    struct hash_table_entry *deferred = allocator->alloc(
+      capacity * sizeof(*deferred),
+      allocator->context
+    );
+
+    if (!deferred) {
+      return false;
+    }
+
+    if (worker->deferred) {
+      memcpy(
+        deferred,
+        worker->deferred,
+        worker->deferred_count * sizeof(*deferred)
+      );
+
+      allocator->free(
+        worker->deferred,
+        worker->deferred_capacity * sizeof(*deferred),
+        allocator->context
+      );
+    }
+
+    worker->deferred = deferred;
+    worker->deferred_capacity = capacity;
+  }
+
+  worker->deferred[worker->deferred_count++] = *entry;
+
+  return true;
+}
+
+static void hash_table_build_entry_free(
+  struct hash_table_build_worker *worker,
+  struct hash_table_entry *entry
+) {
+  if (!hash_table_key_is_inline(entry->key_length)) {
+    rash_arena_free(&worker->arena, entry->key_length + 1);
+  }
+}
+
+#endif
+
+static bool hash_table_should_replace_entry(uint8_t dist1, uint8_t dist2) {
+  return dist1 > dist2;
+}
+
+static void hash_table_swap_entry(
+  struct hash_table_buckets *buckets,
+  size_t position,
+  struct hash_table_entry *entry,
+  uint8_t *dist
+) {
+
+  struct hash_table_entry current = buckets->entries[position];
+  uint8_t current_dist = buckets->dists[position];
+
+  buckets->entries[position] = *entry;
+  buckets->dists[position] = *dist;
+  buckets->tags[position] = hash_table_get_tag(entry->hash);
+
+  *entry = current;
+  *dist = current_dist;
+}
+
+static bool hash_table_remove_from_position(
+  struct hash_table *table,
+  size_t position
+) {
+
+  struct hash_table_buckets *buckets = &table->buckets;
+
+  // Mark the current position as empty (note that the caller
+  // must have dealt with freeing memory).
+  buckets->dists[position] = 0;
+
+  position++;
+
+  HASH_TABLE_ITERATE_TO_END(table, position) {
+  
+    uint8_t dist = buckets->dists[position];
+
+    // If we reach an empty slot (zero), or the current entry is in
+    // its intended place (one) then we can stop iterating.
+    if (dist <= 1) {
+      break;
+    }
+
+    // Otherwise we can move all entries down by one slot to
+    // make them closer to their desired position.
+    buckets->entries[position - 1] = buckets->entries[position];
+    buckets->tags[position - 1] = buckets->tags[position];
+    buckets->dists[position - 1] = dist - 1;
+    buckets->dists[position] = 0;
+  }
+
+  table->curr_size--;
+
+  return true;
+}
+
+static void hash_table_unwind_insertion_changes(
+  struct hash_table *table,
+  const struct hash_table_entry *inserted,
+  struct hash_table_entry poor,
+  uint8_t poor_dist,
+  size_t unwind_start_position
+) {
+
+  // Stopping condition is inside the the for loop.
+  // i is unsigned therefore no point checking if
+  // it is greater than or equal to 0, because it 
+  // will never be a negative number.
+  for (size_t i = unwind_start_position; ; i--) {
+
+    // Each iteration backwards, the poor element gets a
+    // bit richer.
+    poor_dist--;
+
+    // Check if the current element is richer than the poor
+    // element. If it is then swap them.
+    if (hash_table_should_replace_entry(table->buckets.dists[i], poor_dist)) {
+      hash_table_swap_entry(&table->buckets, i, &poor, &poor_dist);
+    }
+    
+    // Stop once the poor element is the same as the element
+    // that was inserted (meaning we have removed the
+    // element that was inserted).
+    //
+    // Also stop once at the beginning of the array. However this
+    // should never happen without poor also being equal to
+    // inserted.
+    if (hash_table_entry_is_same(&poor, inserted) || i == 0) {
+      break; 
+    }
+  }
+}
+
+static bool hash_table_insert(
+  struct hash_table *table,
+  struct hash_table_entry entry
+) {
+
+  uint8_t probe_count = 0;
+  struct hash_table_entry rich = entry;
+  uint8_t rich_dist = 1;
+  uint8_t tag = hash_table_get_tag(entry.hash);
+  size_t position = hash_table_get_position(table, entry.hash);
+  struct hash_table_key key = hash_table_entry_get_key(&entry);
+
+  // Iterate through the buckets until we (hopefully) find an available
+  // one. An available bucket is either:
+  //
+  //   - An empty slot.
+  //
+  //   - A slot that has the same key (meaning the element in the bucket
+  //     is being replaced).
+  HASH_TABLE_ITERATE_TO_NEXT(table, &key, tag, position, probe_count) {
+
+    // Check if we should swap the elements.
+    if (
+      hash_table_should_replace_entry(
+        rich_dist,
+        table->buckets.dists[position]
+      )
+    ) {
+      hash_table_swap_entry(&table->buckets, position, &rich, &rich_dist);
+    }
+    
+    rich_dist++;
+  }
+
+  // Check if we found an available slot.
+  if (hash_table_is_next_found(table, probe_count)) {
+    
+    // If the slot has something in it (above if statement checks if it has
+    // the same key) then free it.
+    if (table->buckets.dists[position]) {
+      hash_table_entry_free(table, &table->buckets.entries[position]);
+
+    } else {
+    
+      // We only want to increase the size if we are not replacing
+      // an element.
+      table->curr_size++;
+    }
+
+    hash_table_swap_entry(&table->buckets, position, &rich, &rich_dist);
+
+    return true;
+ 
+  // This means we couldn't find an appropriate empty slot. 
+  } else {
+
+    // Undo all the changes we made in the above iteration. This is
+    // important in case the reallocation fails - we don't want to
+    // leave the underlying array in the state of a partial insertion.
+    // So we undo what we've done.
+    hash_table_unwind_insertion_changes(
+      table,
+      &entry,
+      rich,
+      rich_dist,
+      position - 1
+    );
+
+    uint64_t seed = table->seed;
+
+    // Exceeding the maximum probe count at a low load factor with keys
+    // that all want the same position means that they collide (probably
+    // on purpose), so growing the table would waste memory without
+    // helping. Rehash with a new seed.
+    if (
+      hash_table_should_reseed(
+        table,
+        hash_table_get_position(table, entry.hash)
+      )
+    ) {
+      if (!hash_table_reseed(table)) {
+        return false;
+      }
+
+    } else if (!hash_table_grow(table)) {
+      return false;
+    }
+
+    // The hash of the entry changes with the seed.
+    if (table->seed != seed) {
+      entry.hash = hash_table_hash_key(
+        table,
+        hash_table_entry_get_key_value(&entry),
+        entry.key_length
+      );
+    }
+
+    // Try to insert again.
+    return hash_table_insert(table, entry);
+  }
+}
+
+static void hash_table_rehash(
+  struct hash_table *table,
+  const struct hash_table_buckets *old_buckets,
+  size_t old_max_size,
+  uint8_t old_max_size_shift,
+  uint64_t old_seed
+) {
+
+  size_t i = 0;
+
+  // Iterate through every bucket.
+  HASH_TABLE_ITERATE_BUCKETS_TO_END(i, old_max_size, old_max_size_shift) {
+
+    // If the bucket contains something then insert it into the
+    // new buckets (the distance is worked out again on insertion).
+    if (old_buckets->dists[i]) {
+
+      struct hash_table_entry entry = old_buckets->entries[i];
+
+      // The table may also have been reseeded part way through, by
+      // one of the insertions.
+      if (table->seed != old_seed) {
+        entry.hash = hash_table_hash_key(
+          table,
+          hash_table_entry_get_key_value(&entry),
+          entry.key_length
+        );
+      }
+
+      hash_table_insert(table, entry);
+    }
+  }
+}
+
+static bool hash_table_migrate(
+  struct hash_table *table,
+  const struct hash_table_buckets *old_buckets,
+  size_t old_max_size,
+  uint8_t old_max_size_shift
+) {
+
+  // Without wrapping, a Robin Hood table is sorted by desired position.
+  // fibonacci_hash uses the top bits of the hash, so changing the size
+  // keeps that order, apart from between entries that wanted the same
+  // old position (growing by one maps position p to 2p or 2p + 1). The
+  // entries in each of these groups are sorted by their new position,
+  // and then placed at the first free bucket at or after it.
+  size_t end = old_max_size + old_max_size_shift;
+  size_t next_free = 0;
+  size_t i = 0;
+
+  while (i < end) {
+
+    if (!old_buckets->dists[i]) {
+      i++;
+      continue;
+    }
+
+    // Entries that want the same position are next to each other, and
+    // there can be no more of them than the maximum probe count.
+    size_t group[sizeof(size_t) * 8];
+    size_t positions[sizeof(size_t) * 8];
+    uint8_t group_size = 0;
+    size_t old_position = i - (old_buckets->dists[i] - 1);
+
+    for (
+      ;
+      i < end &&
+      old_buckets->dists[i] &&
+      i - (old_buckets->dists[i] - 1) == old_position;
+      i++
+    ) {
+
+      size_t position = hash_table_get_position(
+        table,
+        old_buckets->entries[i].hash
+      );
+
+      // Insertion sort (the groups are tiny).
+      uint8_t j = group_size++;
+      for (; j > 0 && positions[j - 1] > position; j--) {
+        group[j] = group[j - 1];
+        positions[j] = positions[j - 1];
+      }
+
+      group[j] = i;
+      positions[j] = position;
+    }
+
+    for (uint8_t j = 0; j < group_size; j++) {
+
+      size_t position = positions[j] > next_free ? positions[j] : next_free;
+      size_t dist = position - positions[j] + 1;
+
+      if (dist > table->max_size_shift) {
+        memset(table->buckets.dists, 0, next_free);
+        table->curr_size = 0;
+        return false;
+      }
+
+      table->buckets.entries[position] = old_buckets->entries[group[j]];
+      table->buckets.dists[position] = (uint8_t) dist;
+      table->buckets.tags[position] = old_buckets->tags[group[j]];
+      table->curr_size++;
+
+      next_free = position + 1;
+    }
+  }
+
+  return true;
+}
+
+static bool hash_table_resize(struct hash_table *table, int shift_amount) {
+
+  // Store the old sizes so that we can restore them if the reallocation
+  // fails.
+  size_t old_max_size = table->max_size;
+  uint8_t old_max_size_shift = table->max_size_shift;
+
+  table->max_size_shift += shift_amount;
+
+  // It is undefined behaviour to have a negative shift
+  // (little bit annoying because it would have made the
+  // code much cleaner).
+  if (shift_amount >= 0) {
+    table->max_size <<= shift_amount;
+  } else {
+    table->max_size >>= -1 * shift_amount;
+  }
+
+  // Create the new buckets.
+  struct hash_table_buckets new_buckets;
+
+  if (!hash_table_buckets_alloc(table, &new_buckets)) {
+    table->max_size = old_max_size;
+    table->max_size_shift = old_max_size_shift;
+    return false;
+  }
+
+  struct hash_table_buckets old_buckets = table->buckets;
+  table->buckets = new_buckets;
+  table->curr_size = 0;
+  table->reseed_count = 0;
+
+  // The general rehash is only needed in the (very unlikely) case of
+  // an entry ending up too far from its desired position, for which
+  // the table has to grow again.
+  if (
+    !hash_table_migrate(
+      table,
+      &old_buckets,
+      old_max_size,
+      old_max_size_shift
+    )
+  ) {
+    hash_table_rehash(
+      table,
+      &old_buckets,
+      old_max_size,
+      old_max_size_shift,
+      table->seed
+    );
+  }
+
+  // We don't need the old buckets any more.
+  hash_table_buckets_free(table, &old_buckets);
+
+  return true;
+}
+
+static bool hash_table_reseed(struct hash_table *table) {
+
+  struct hash_table_buckets new_buckets;
+
+  if (!hash_table_buckets_alloc(table, &new_buckets)) {
+    return false;
+  }
+
+  struct hash_table_buckets old_buckets = table->buckets;
+  uint64_t old_seed = table->seed;
+
+  table->buckets = new_buckets;
+  table->curr_size = 0;
+  table->reseed_count++;
+  table->seed = hash_table_random_seed(table);
+
+  hash_table_rehash(
+    table,
+    &old_buckets,
+    table->max_size,
+    table->max_size_shift,
+    old_seed
+  );
+
+  hash_table_buckets_free(table, &old_buckets);
+
+  return true;
+}
+
+static bool hash_table_grow(struct hash_table *table) {
+
+  // There can only be one old table. If the entries of the previous one
+  // are still being moved (this may even be one of those moves), the
+  // current buckets are resized straight away instead, which is fine
+  // as the old table is normally empty long before the table needs to
+  // grow again.
+  if (table->incremental && !table->old) {
+    return hash_table_resize_incremental(table, HASH_TABLE_RESIZE_INCREMENT);
+  }
+
+  return hash_table_resize(table, HASH_TABLE_RESIZE_INCREMENT);
+}
+
+static bool hash_table_resize_incremental(
+  struct hash_table *table,
+  int shift_amount
+) {
+
+  struct hash_table *old = table->allocator.alloc(
+    sizeof(*old),
+    table->allocator.context
+  );
+
+  if (!old) {
+    return false;
+  }
+
+  // The old table is a copy of this one, which keeps the current
+  // buckets (and so can be searched and removed from as normal). Its
+  // keys still belong to this table.
+  *old = *table;
+  rash_arena_init(&old->arena, &table->allocator);
+
+  struct hash_table_buckets new_buckets;
+
+  table->max_size_shift += shift_amount;
+  table->max_size <<= shift_amount;
+
+  if (!hash_table_buckets_alloc(table, &new_buckets)) {
+    table->max_size = old->max_size;
+    table->max_size_shift = old->max_size_shift;
+    table->allocator.free(old, sizeof(*old), table->allocator.context);
+    return false;
+  }
+
+  table->buckets = new_buckets;
+  table->curr_size = 0;
+  table->reseed_count = 0;
+  table->old = old;
+  table->migrate_position = 0;
+
+  return true;
+}
+
+static bool hash_table_migrate_step(struct hash_table *table, size_t count) {
+
+  struct hash_table *old = table->old;
+
+  if (!old) {
+    return true;
+  }
+
+  size_t end = old->max_size + old->max_size_shift;
+
+  for (; count > 0 && table->migrate_position < end; count--) {
+
+    size_t position = table->migrate_position;
+
+    if (!old->buckets.dists[position]) {
+      table->migrate_position++;
+      continue;
+    }
+
+    // Insert before removing, so that the entry is not lost if the
+    // insertion fails (insertions never touch the old table). Removing
+    // moves the following entries down, so the same position is looked
+    // at again next time.
+    if (!hash_table_insert(table, old->buckets.entries[position])) {
+      return false;
+    }
+
+    hash_table_remove_from_position(old, position);
+  }
+
+  if (table->migrate_position == end) {
+    hash_table_buckets_free(table, &old->buckets);
+    table->allocator.free(old, sizeof(*old), table->allocator.context);
+    table->old = NULL;
+  }
+
+  return true;
+}
+
+static void hash_table_entry_free(
+  struct hash_table *table,
+  struct hash_table_entry *entry
+) {
+
+  if (hash_table_key_is_inline(entry->key_length)) {
+    return;
+  }
+
+  char *key = hash_table_entry_get_key_pointer(entry);
+
+  switch (hash_table_entry_get_key_owner(entry)) {
+
+    case HASH_TABLE_KEY_COPIED:
+      break;
+
+    case HASH_TABLE_KEY_BORROWED:
+      return;
+
+    case HASH_TABLE_KEY_OWNED:
+      table->allocator.free(
+        key,
+        entry->key_length + 1,
+        table->allocator.context
+      );
+      return;
+  }
+
+  switch (table->key_storage) {
+
+    case HASH_TABLE_KEYS_ARENA:
+      rash_arena_free(&table->arena, entry->key_length + 1);
+      break;
+
+    case HASH_TABLE_KEYS_INTERNED:
+      hash_table_interner_release(table->interner, key, entry->key_length);
+      break;
+  }
+}
+
+static void hash_table_entries_free(
+  struct hash_table *table,
+  struct hash_table *owner,
+  void (*cb)(void *)
+) {
+
+  size_t i = 0;
+
+  HASH_TABLE_ITERATE_TO_END(owner, i) {
+  
+    struct hash_table_entry *entry = &owner->buckets.entries[i];
+
+    if (owner->buckets.dists[i]) {
+
+      if (cb) {
+        cb(entry->data);
+      }
+
+      hash_table_entry_free(table, entry);
+    }
+  }
+}
+
+static void *hash_table_default_alloc(size_t size, void *context) {
+  (void) context;
+  return malloc(size);
+}
+
+static void hash_table_default_free(void *memory, size_t size, void *context) {
+  (void) size;
+  (void) context;
+  free(memory);
+}
+
+static void *hash_table_alloc_zeroed(
+  const struct hash_table *table,
+  size_t size
+) {
+
+  // calloc can avoid writing to the memory (which is often fresh from
+  // the operating system, so already zero).
+  if (table->allocator.alloc == hash_table_default_alloc) {
+    return calloc(1, size);
+  }
+
+  void *memory = table->allocator.alloc(size, table->allocator.context);
+
+  if (memory) {
+    memset(memory, 0, size);
+  }
+
+  return memory;
+}
+
+#if defined(HASH_TABLE_MMAP)
+static size_t hash_table_round_huge(size_t size) {
+  return (size + HASH_TABLE_HUGE_PAGE_SIZE - 1) &
+    ~(HASH_TABLE_HUGE_PAGE_SIZE - 1);
+}
+#endif
+
+static void *hash_table_map_huge(size_t size) {
+
+#if defined(HASH_TABLE_MMAP)
+  size = hash_table_round_huge(size);
+
+  int protection = PROT_READ | PROT_WRITE;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#if defined(MAP_HUGETLB)
+  // Explicit huge pages only exist if the administrator has reserved
+  // some, so this often fails.
+  void *huge = mmap(NULL, size, protection, flags | MAP_HUGETLB, -1, 0);
+
+  if (huge != MAP_FAILED) {
+    return huge;
+  }
+#endif
+
+  // Transparent huge pages are only used for the parts of a mapping
+  // which are aligned to a huge page, so map an extra page and trim
+  // the ends back to an aligned range.
+  size_t mapped_size = size + HASH_TABLE_HUGE_PAGE_SIZE;
+  char *memory = mmap(NULL, mapped_size, protection, flags, -1, 0);
+
+  if (memory == MAP_FAILED) {
+    return NULL;
+  }
+
+  size_t head = HASH_TABLE_HUGE_PAGE_SIZE -
+    (uintptr_t) memory % HASH_TABLE_HUGE_PAGE_SIZE;
+
+  if (head == HASH_TABLE_HUGE_PAGE_SIZE) {
+    head = 0;
+  }
+
+  if (head) {
+    munmap(memory, head);
+  }
+
+  munmap(memory + head + size, HASH_TABLE_HUGE_PAGE_SIZE - head);
+
+  memory += head;
+
+#if defined(MADV_HUGEPAGE)
+  // Only a hint, so failure (such as the kernel not supporting it)
+  // doesn't matter.
+  madvise(memory, size, MADV_HUGEPAGE);
+#endif
+
+  return memory;
+#else
+  (void) size;
+  return NULL;
+#endif
+}
+
+static void hash_table_unmap_huge(void *memory, size_t size) {
+#if defined(HASH_TABLE_MMAP)
+  munmap(memory, hash_table_round_huge(size));
+#else
+  (void) memory;
+  (void) size;
+#endif
+}
+
+static bool hash_table_buckets_alloc(
+  const struct hash_table *table,
+  struct hash_table_buckets *buckets
+) {
+
+  /*
+   * Adding on table->max_size_shift (which is also the maximum
+   * probe count) means that we never have to worry about wrapping
+   * from the end of the array back to the beginning during probing.
+  */
+  size_t count = table->max_size + table->max_size_shift;
+  size_t metadata_count = count + HASH_TABLE_METADATA_PADDING;
+
+  size_t bucket_size =
+    sizeof(*buckets->entries) +
+    sizeof(*buckets->dists) +
+    sizeof(*buckets->tags);
+
+  size_t padding_size =
+    HASH_TABLE_METADATA_PADDING *
+    (sizeof(*buckets->dists) + sizeof(*buckets->tags));
+
+  // The size of the table is only limited to what fits in a size_t, so
+  // the size of the memory needs checking too (on 32 bit platforms a
+  // few hundred million buckets is enough to overflow it).
+  if (count > (SIZE_MAX - padding_size) / bucket_size) {
+    return false;
+  }
+
+  // Each bucket needs an entry, a distance and a tag.
+  size_t memory_size =
+    count * sizeof(*buckets->entries) +
+    metadata_count * (sizeof(*buckets->dists) + sizeof(*buckets->tags));
+
+  unsigned char *memory = NULL;
+  bool mapped = false;
+
+  // Mappings bypass the allocator, so they are only used if the table
+  // was not given one. Fall back to the allocator if the mapping
+  // fails.
+  if (
+    table->huge_page_threshold &&
+    memory_size >= table->huge_page_threshold &&
+    table->allocator.alloc == hash_table_default_alloc
+  ) {
+    memory = hash_table_map_huge(memory_size);
+    mapped = memory != NULL;
+  }
+
+  if (!memory) {
+    memory = hash_table_alloc_zeroed(table, memory_size);
+  }
+
+  if (!memory) {
+    return false;
+  }
+
+  buckets->memory_size = memory_size;
+  buckets->mapped = mapped;
+  buckets->entries = (struct hash_table_entry *) memory;
+  buckets->dists = memory + count * sizeof(*buckets->entries);
+  buckets->tags = buckets->dists + metadata_count;
+
+  return true;
+}
+
+static void hash_table_buckets_free(
+  const struct hash_table *table,
+  struct hash_table_buckets *buckets
+) {
+
+  if (buckets->mapped) {
+    hash_table_unmap_huge(buckets->entries, buckets->memory_size);
+    return;
+  }
+
+  table->allocator.free(
+    buckets->entries,
+    buckets->memory_size,
+    table->allocator.context
+  );
+}
+
+static bool hash_table_key_is_inline(size_t length) {
+  return length < HASH_TABLE_INLINE_KEY_SIZE;
+}
+
+static const char *hash_table_entry_get_key_value(
+  const struct hash_table_entry *entry
+) {
+
+  if (hash_table_key_is_inline(entry->key_length)) {
+    return entry->key;
+  }
+
+  return hash_table_entry_get_key_pointer(entry);
+}
+
+static char *hash_table_entry_get_key_pointer(
+  const struct hash_table_entry *entry
+) {
+  char *pointer;
+  memcpy(&pointer, entry->key, sizeof(pointer));
+  return pointer;
+}
+
+static void hash_table_entry_set_key_pointer(
+  struct hash_table_entry *entry,
+  char *pointer
+) {
+  memcpy(entry->key, &pointer, sizeof(pointer));
+}
+
+static enum hash_table_key_owner hash_table_entry_get_key_owner(
+  const struct hash_table_entry *entry
+) {
+  return (enum hash_table_key_owner) entry->key[HASH_TABLE_KEY_OWNER_INDEX];
+}
+
+static void hash_table_entry_set_key_owner(
+  struct hash_table_entry *entry,
+  enum hash_table_key_owner owner
+) {
+  entry->key[HASH_TABLE_KEY_OWNER_INDEX] = (char) owner;
+}
+
+static bool hash_table_entry_is_same(
+  const struct hash_table_entry *entry1,
+  const struct hash_table_entry *entry2
+) {
+
+  // Keys are unique within a table, so two entries are the same if
+  // their keys are stored in the same way (the same pointer or the
+  // same inline bytes, which are zeroed past the terminator).
+  return entry1->key_length == entry2->key_length &&
+    memcmp(entry1->key, entry2->key, sizeof(entry1->key)) == 0;
+}
+
+static bool hash_table_entry_init(
+  struct hash_table_entry *entry,
+  const struct hash_table_key *key,
+  void *data
+) {
+
+  memset(entry, 0, sizeof(*entry));
+
+  if (key->length > UINT32_MAX) {
+    return false;
+  }
+
+  entry->key_length = (uint32_t) key->length;
+  entry->hash = key->hash;
+  entry->data = data;
+
+  // The rest of the key (including the terminator) has been zeroed.
+  if (hash_table_key_is_inline(key->length)) {
+    memcpy(entry->key, key->value, key->length);
+  }
+
+  return true;
+}
+
+static bool hash_table_entry_create(
+  struct hash_table *table,
+  struct hash_table_entry *entry,
+  const struct hash_table_key *key,
+  void *data
+) {
+
+  if (!hash_table_entry_init(entry, key, data)) {
+    return false;
+  }
+
+  if (hash_table_key_is_inline(key->length)) {
+    return true;
+  }
+
+  char *copy;
+
+  // Interned keys are already copies.
+  if (table->key_storage == HASH_TABLE_KEYS_INTERNED) {
+    copy = hash_table_interner_acquire(table->interner, key);
+
+  } else {
+
+    // Make a copy of the key, adding a terminator (the key may not
+    // have one).
+    copy = rash_arena_alloc(&table->arena, key->length + 1);
+
+    if (copy) {
+      memcpy(copy, key->value, key->length);
+      copy[key->length] = '\0';
+    }
+  }
+
+  if (!copy) {
+    return false;
+  }
+
+  hash_table_entry_set_key_pointer(entry, copy);
+
+  return true;
+}
+
+static bool hash_table_should_compact_keys(const struct hash_table *table) {
+
+  const struct rash_arena *arena = &table->arena;
+
+  return table->key_storage == HASH_TABLE_KEYS_ARENA &&
+    arena->dead >= RASH_ARENA_MAX_BLOCK_SIZE &&
+    arena->dead > arena->live * HASH_TABLE_DEAD_KEYS_FACTOR;
+}
+
+static void hash_table_compact_keys(struct hash_table *table) {
+
+  struct rash_arena arena;
+  rash_arena_init(&arena, &table->allocator);
+
+  // Make sure the copies can't fail part way through.
+  if (!rash_arena_reserve(&arena, table->arena.live)) {
+    return;
+  }
+
+  struct hash_table *owners[] = { table, table->old };
+
+  for (size_t j = 0; j < sizeof(owners) / sizeof(owners[0]); j++) {
+
+    struct hash_table *owner = owners[j];
+    size_t i = 0;
+
+    if (!owner) {
+      continue;
+    }
+
+    HASH_TABLE_ITERATE_TO_END(owner, i) {
+
+      struct hash_table_entry *entry = &owner->buckets.entries[i];
+
+      if (
+        owner->buckets.dists[i] &&
+        !hash_table_key_is_inline(entry->key_length) &&
+        hash_table_entry_get_key_owner(entry) == HASH_TABLE_KEY_COPIED
+      ) {
+
+        char *key = rash_arena_alloc(&arena, entry->key_length + 1);
+        memcpy(
+          key,
+          hash_table_entry_get_key_pointer(entry),
+          entry->key_length + 1
+        );
+
+        hash_table_entry_set_key_pointer(entry, key);
+      }
+    }
+  }
+
+  rash_arena_destroy(&table->arena);
+  table->arena = arena;
+}
+
+static struct hash_table_key hash_table_entry_get_key(
+  const struct hash_table_entry *entry
+) {
+
+  struct hash_table_key key;
+
+  key.value = hash_table_entry_get_key_value(entry);
+  key.length = entry->key_length;
+  key.hash = entry->hash;
+
+  return key;
+}
+
+static uint8_t hash_table_get_shift_for_capacity(size_t capacity) {
+
+  uint8_t shift = HASH_TABLE_INITIAL_SHIFT;
+
+  while (capacity > ((size_t) 1 << shift) * HASH_TABLE_LOAD_FACTOR_INCREASE) {
+
+    shift++;
+
+    // The size (plus padding) must still fit in a size_t.
+    if (shift >= sizeof(size_t) * 8 - 1) {
+      return 0;
+    }
+  }
+
+  return shift;
+}
+
+static bool hash_table_should_resize_up_factor(
+  const struct hash_table *table
+) {
+
+  // Add one to check if we have room for the item we might be
+  // adding.
+  return hash_table_get_size(table) + 1 >
+    table->max_size * HASH_TABLE_LOAD_FACTOR_INCREASE;
+}
+
+static bool hash_table_should_resize_down_factor(
+  const struct hash_table *table
+) {
+
+  // Never go lower than the minimum shift, or shrink while still
+  // growing.
+  if (table->max_size_shift <= HASH_TABLE_INITIAL_SHIFT || table->old) {
+    return false;
+  }
+
+  return hash_table_get_size(table) - 1 <
+    table->max_size * HASH_TABLE_LOAD_FACTOR_DECREASE;
+}
+
+struct hash_table *hash_table_create() {
+  return hash_table_create_ex(NULL);
+}
+
+struct hash_table *hash_table_create_ex(
+  const struct hash_table_options *options
+) {
+
+  struct hash_table_allocator allocator;
+  allocator.alloc = hash_table_default_alloc;
+  allocator.free = hash_table_default_free;
+  allocator.context = NULL;
+
+  if (options && options->allocator) {
+    allocator = *options->allocator;
+  }
+
+  struct hash_table *table = allocator.alloc(sizeof(*table), allocator.context);
+  if (!table) {
+    return NULL;   
+  }
+  memset(table, 0, sizeof(*table));
+
+  table->allocator = allocator;
+  rash_arena_init(&table->arena, &table->allocator);
+
+  if (options) {
+    table->hash = options->hash;
+    table->equal = options->equal;
+    table->context = options->context;
+    table->incremental = options->incremental;
+    table->huge_page_threshold = options->huge_page_threshold;
+
+    if (options->interner) {
+      table->key_storage = HASH_TABLE_KEYS_INTERNED;
+      table->interner = options->interner;
+    }
+  }
+
+  // Picked for each table (rather than once for the process), so
+  // there is nothing shared between tables. The fastest hash function
+  // (rash_hash_select) isn't used, as with the CRC based one, keys that
+  // collide do so whatever the seed.
+  table->builtin_hash = rash_hash_select_seeded();
+  table->seed = hash_table_random_seed(table);
+  
+  table->max_size_shift = hash_table_get_shift_for_capacity(
+    options ? options->capacity : 0
+  );
+
+  if (!table->max_size_shift) {
+    allocator.free(table, sizeof(*table), allocator.context);
+    return NULL;
+  }
+
+  table->max_size = (size_t) 1 << table->max_size_shift;
+
+  if (!hash_table_buckets_alloc(table, &table->buckets)) {
+    allocator.free(table, sizeof(*table), allocator.context);
+    return NULL;
+  }
+  
+  return table;
+}
+
+struct hash_table *hash_table_create_with_capacity(size_t capacity) {
+
+  struct hash_table_options options = {0};
+  options.capacity = capacity;
+
+  return hash_table_create_ex(&options);
+}
+
+bool hash_table_reserve(struct hash_table *table, size_t capacity) {
+
+  uint8_t shift = hash_table_get_shift_for_capacity(capacity);
+
+  if (!shift) {
+    return false;
+  }
+
+  // Never make the table smaller.
+  if (shift <= table->max_size_shift) {
+    return true;
+  }
+
+  // Resize straight to the final size, so that the entries are
+  // only moved once.
+  if (!hash_table_resize(table, shift - table->max_size_shift)) {
+    return false;
+  }
+
+  // The entries which are still in the old table go straight into the
+  // final buckets as well, rather than into the current ones first.
+  // Nothing is reseeded while there is an old table, so the seed is
+  // still the same.
+  struct hash_table *old = table->old;
+
+  if (old) {
+
+    hash_table_rehash(
+      table,
+      &old->buckets,
+      old->max_size,
+      old->max_size_shift,
+      table->seed
+    );
+
+    hash_table_buckets_free(table, &old->buckets);
+    table->allocator.free(old, sizeof(*old), table->allocator.context);
+    table->old = NULL;
+  }
+
+  // Every entry has just been moved anyway.
+  if (hash_table_should_compact_keys(table)) {
+    hash_table_compact_keys(table);
+  }
+
+  return true;
+}
+
+void hash_table_free_callback(struct hash_table *table, void (*cb)(void *)) {
+
+  if (table->old) {
+    hash_table_entries_free(table, table->old, cb);
+    hash_table_buckets_free(table, &table->old->buckets);
+    table->allocator.free(
+      table->old,
+      sizeof(*table->old),
+      table->allocator.context
+    );
+  }
+
+  hash_table_entries_free(table, table, cb);
+  hash_table_buckets_free(table, &table->buckets);
+  rash_arena_destroy(&table->arena);
+
+  // The table is freed with a copy of the allocator, as the allocator
+  // is part of the table.
+  struct hash_table_allocator allocator = table->allocator;
+  allocator.free(table, sizeof(*table), allocator.context);
+}
+
+void hash_table_free(struct hash_table *table) {
+  hash_table_free_callback(table, NULL);
+}
+
+bool hash_table_add(struct hash_table *table, const char *key, void *data) {
+  return hash_table_add_n(table, key, strlen(key), data);
+}
+
+bool hash_table_add_n(
+  struct hash_table *table,
+  const char *key,
+  size_t length,
+  void *data
+) {
+  return hash_table_add_with_owner(
+    table,
+    key,
+    length,
+    data,
+    NULL,
+    HASH_TABLE_KEY_COPIED
+  );
+}
+
+bool hash_table_replace(
+  struct hash_table *table,
+  const char *key,
+  void *data,
+  void **previous
+) {
+  return hash_table_add_with_owner(
+    table,
+    key,
+    strlen(key),
+    data,
+    previous,
+    HASH_TABLE_KEY_COPIED
+  );
+}
+
+bool hash_table_add_borrowed(
+  struct hash_table *table,
+  const char *key,
+  void *data
+) {
+  return hash_table_add_with_owner(
+    table,
+    key,
+    strlen(key),
+    data,
+    NULL,
+    HASH_TABLE_KEY_BORROWED
+  );
+}
+
+bool hash_table_add_owned(struct hash_table *table, char *key, void *data) {
+  return hash_table_add_with_owner(
+    table,
+    key,
+    strlen(key),
+    data,
+    NULL,
+    HASH_TABLE_KEY_OWNED
+  );
+}
+
+void **hash_table_get_or_insert(
+  struct hash_table *table,
+  const char *key,
+  bool *inserted
+) {
+
+  struct hash_table_key lookup = hash_table_key_create(table, key, strlen(key));
 
-  HASH_TABLE_ITERATE_TO_END(table, position) {
-  
-    struct hash_table_entry *entry = table->buckets[position];
+  // An existing key is found without changing the table at all.
+  struct hash_table_entry *entry = hash_table_find_entry(table, &lookup);
 
-    // If we reach an empty slot, or the current entry is in its
-    // intended place then we can stop iterating.
-    if (entry == NULL || entry->dist_from_des == 0) {
-      break;
+  if (entry) {
+    if (inserted) {
+      *inserted = false;
     }
 
-    // Otherwise we can move all entries down by one slot to
-    // make them closer to their desired position.
-    entry->dist_from_des--;
+    return &entry->data;
+  }
+
+  uint64_t seed = table->seed;
+
+  if (!hash_table_add_missing(table, &lookup, NULL, HASH_TABLE_KEY_COPIED)) {
+    return NULL;
+  }
 
-    table->buckets[position - 1] = entry;
-    table->buckets[position] = NULL;
+  // Inserting can reseed the table.
+  if (table->seed != seed) {
+    lookup.hash = hash_table_hash_key(table, lookup.value, lookup.length);
   }
 
-  table->curr_size--;
+  // New entries always go in the current buckets, but where depends on
+  // the entries around them. The key has just been added, so it must
+  // be found.
+  size_t position;
+  bool found = hash_table_find(table, &lookup, &position);
+  assert(found);
+  (void) found;
 
-  return true;
+  if (inserted) {
+    *inserted = true;
+  }
+
+  return &table->buckets.entries[position].data;
 }
 
-static void hash_table_unwind_insertion_changes(
+bool hash_table_add_batch(
   struct hash_table *table,
-  struct hash_table_entry *inserted,
-  struct hash_table_entry *original,
-  size_t unwind_start_position
+  const struct hash_table_pair *pairs,
+  size_t n
 ) {
 
-  struct hash_table_entry *poor = original;
+  size_t size = hash_table_get_size(table);
 
-  // Stopping condition is inside the the for loop.
-  // i is unsigned therefore no point checking if
-  // it is greater than or equal to 0, because it 
-  // will never be a negative number.
-  for (size_t i = unwind_start_position; ; i--) {
+  if (n > SIZE_MAX - size) {
+    return false;
+  }
 
-    struct hash_table_entry *current = table->buckets[i];
-    
-    // Each iteration backwards, the poor element gets a
-    // bit richer.
-    poor->dist_from_des--;
+  // Grow once, to a size big enough for every pair (assuming none of
+  // them replace an element), so that the load factor never needs to
+  // be checked.
+  if (!hash_table_reserve(table, size + n)) {
+    return false;
+  }
 
-    // Check if the current element is richer than the poor
-    // element. If it is then swap them.
-    if (hash_table_should_replace_entry(current, poor)) {
-      table->buckets[i] = poor;
-      poor = current;
+  struct hash_table_key keys[HASH_TABLE_BATCH_SIZE];
+
+  for (size_t start = 0; start < n; start += HASH_TABLE_BATCH_SIZE) {
+
+    size_t count = n - start;
+    if (count > HASH_TABLE_BATCH_SIZE) {
+      count = HASH_TABLE_BATCH_SIZE;
     }
-    
-    // Stop once the poor element is the same as the element
-    // that was inserted (meaning we have removed the
-    // element that was inserted).
-    //
-    // Also stop once at the beginning of the array. However this
-    // should never happen without poor also being equal to
-    // inserted.
-    if (poor == inserted || i == 0) {
-      break; 
+
+    if (hash_table_should_compact_keys(table)) {
+      hash_table_compact_keys(table);
     }
-  }
-}
 
-static bool hash_table_insert(
-  struct hash_table *table,
-  struct hash_table_entry *entry
-) {
+    // Hash every key and start loading its buckets before any of them
+    // are inserted (see hash_table_get_batch).
+    for (size_t i = 0; i < count; i++) {
+      const char *key = pairs[start + i].key;
+      keys[i] = hash_table_key_create(table, key, strlen(key));
+      hash_table_prefetch(table, &keys[i]);
+    }
 
-  uint8_t probe_count = 0;
-  struct hash_table_entry *rich = entry;
-  size_t position = fibonacci_hash(entry->hash, table->max_size_shift);
+    uint64_t seed = table->seed;
 
-  // Iterate through the buckets until we (hopefully) find an available
-  // one. An available bucket is either:
-  //
-  //   - An empty slot.
-  //
-  //   - A slot that has the same key (meaning the element in the bucket
-  //     is being replaced).
-  HASH_TABLE_ITERATE_TO_NEXT(table, entry->key, position, probe_count) {
+    for (size_t i = 0; i < count; i++) {
 
-    struct hash_table_entry *current = table->buckets[position];
+      // Exceeding the maximum probe count can still grow the table
+      // (which might start moving entries across incrementally), or
+      // reseed it, in which case the rest of the keys are rehashed.
+      if (!hash_table_migrate_step(table, HASH_TABLE_MIGRATE_STEP)) {
+        return false;
+      }
 
-    // Check if we should swap the elements.
-    if (hash_table_should_replace_entry(rich, current)) {
-      table->buckets[position] = rich;
-      rich = current;
+      if (table->seed != seed) {
+        seed = table->seed;
+        for (size_t j = i; j < count; j++) {
+          keys[j].hash =
+            hash_table_hash_key(table, keys[j].value, keys[j].length);
+        }
+      }
+
+      if (
+        !hash_table_add_key(
+          table,
+          &keys[i],
+          pairs[start + i].data,
+          HASH_TABLE_KEY_COPIED
+        )
+      ) {
+        return false;
+      }
     }
-    
-    rich->dist_from_des++;
   }
 
-  // Check if we found an available slot.
-  if (hash_table_is_next_found(table, probe_count)) {
-    
-    struct hash_table_entry *current = table->buckets[position];
+  return true;
+}
 
-    // If the slot has something in it (above if statement checks if it has
-    // the same key) then free it.
-    if (current) {
-      hash_table_entry_free(current);
+bool hash_table_remove(struct hash_table *table, const char *key) {
+  return hash_table_remove_n(table, key, strlen(key));
+}
 
-    } else {
-    
-      // We only want to increase the size if we are not replacing
-      // an element.
-      table->curr_size++;
+bool hash_table_remove_n(
+  struct hash_table *table,
+  const char *key,
+  size_t length
+) {
+
+  if (hash_table_should_resize_down_factor(table)) {
+    if (!hash_table_resize(table, -HASH_TABLE_RESIZE_INCREMENT)) {
+      return false;
     }
+  }
 
-    table->buckets[position] = rich;
+  if (!hash_table_migrate_step(table, HASH_TABLE_MIGRATE_STEP)) {
+    return false;
+  }
 
-    return true;
- 
-  // This means we couldn't find an appropriate empty slot. 
-  } else {
+  if (hash_table_should_compact_keys(table)) {
+    hash_table_compact_keys(table);
+  }
+  
+  size_t position;
+  struct hash_table_key lookup = hash_table_key_create(table, key, length);
+  struct hash_table *owner = table;
+  
+  // Find the position of the element (might not actually be
+  // at the desired position if we've done linear probing).
+  if (!hash_table_find(owner, &lookup, &position)) {
 
-    // Undo all the changes we made in the above iteration. This is
-    // important in case the reallocation fails - we don't want to
-    // leave the underlying array in the state of a partial insertion.
-    // So we undo what we've done.
-    hash_table_unwind_insertion_changes(table, entry, rich, position - 1);
+    owner = table->old;
 
-    if (!hash_table_resize(table, HASH_TABLE_RESIZE_INCREMENT)) {
+    if (!owner || !hash_table_find(owner, &lookup, &position)) {
       return false;
     }
+  }
+  
+  // Free the memory then remove it.
+  hash_table_entry_free(table, &owner->buckets.entries[position]);
 
-    // Reset
-    entry->dist_from_des = 0;
+  return hash_table_remove_from_position(owner, position);
+}
 
-    // Try to insert again.
-    return hash_table_insert(table, entry);
-  }
+void *hash_table_get(const struct hash_table *table, const char *key) {
+  return hash_table_get_n(table, key, strlen(key));
 }
 
-static void hash_table_rehash(
-  struct hash_table *table,
-  struct hash_table_entry **old_buckets,
-  size_t old_max_size,
-  uint8_t old_max_size_shift
+void *hash_table_get_n(
+  const struct hash_table *table,
+  const char *key,
+  size_t length
 ) {
+  struct hash_table_key lookup = hash_table_key_create(table, key, length);
+  return hash_table_get_key(table, &lookup);
+}
 
-  size_t i = 0;
+void hash_table_get_batch(
+  const struct hash_table *table,
+  const char *const *keys,
+  size_t n,
+  void **data
+) {
 
-  // Iterate through every bucket.
-  HASH_TABLE_ITERATE_BUCKETS_TO_END(i, old_max_size, old_max_size_shift) {
+  struct hash_table_key lookups[HASH_TABLE_BATCH_SIZE];
 
-    struct hash_table_entry *entry = old_buckets[i];
+  for (size_t start = 0; start < n; start += HASH_TABLE_BATCH_SIZE) {
 
-    // If the bucket contains something, reset its distant and then
-    // insert it into the new buckets.
-    if (entry) {
-      entry->dist_from_des = 0;
-      hash_table_insert(table, entry);
+    size_t count = n - start;
+    if (count > HASH_TABLE_BATCH_SIZE) {
+      count = HASH_TABLE_BATCH_SIZE;
+    }
+
+    // Hash every key and start loading its buckets, so that the cache
+    // misses of the whole batch overlap rather than being taken one
+    // after another.
+    for (size_t i = 0; i < count; i++) {
+      const char *key = keys[start + i];
+      lookups[i] = hash_table_key_create(table, key, strlen(key));
+      hash_table_prefetch(table, &lookups[i]);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      data[start + i] = hash_table_get_key(table, &lookups[i]);
     }
   }
 }
 
-static bool hash_table_resize(struct hash_table *table, int shift_amount) {
-
-  // Store the old sizes so that we can restore them if the reallocation
-  // fails.
-  size_t old_max_size = table->max_size;
-  uint8_t old_max_size_shift = table->max_size_shift;
+bool hash_table_add_parallel(
+  struct hash_table *table,
+  const struct hash_table_pair *pairs,
+  size_t n,
+  unsigned int threads
+) {
 
-  table->max_size_shift += shift_amount;
+#if defined(RASH_THREADS)
 
-  // It is undefined behaviour to have a negative shift
-  // (little bit annoying because it would have made the
-  // code much cleaner).
-  if (shift_amount >= 0) {
-    table->max_size <<= shift_amount;
-  } else {
-    table->max_size >>= -1 * shift_amount;
-  }
+  // The workers copy keys into arenas of their own, and take memory
+  // from several threads at once (which malloc allows).
+  if (
+    threads > 1 &&
+    hash_table_get_size(table) == 0 &&
+    !table->old &&
+    table->key_storage == HASH_TABLE_KEYS_ARENA &&
+    table->allocator.alloc == hash_table_default_alloc
+  ) {
 
-  // Create the new buckets.
-  struct hash_table_entry **new_buckets = hash_table_buckets_alloc(table);
+    if (!hash_table_reserve(table, n)) {
+      return false;
+    }
 
-  if (!new_buckets) {
-    table->max_size = old_max_size;
-    table->max_size_shift = old_max_size_shift;
-    return false;
-  }
+    size_t workers = threads;
 
-  struct hash_table_entry **old_buckets = table->buckets;
-  table->buckets = new_buckets;
-  table->curr_size = 0;
+    if (workers > table->max_size / HASH_TABLE_BUILD_MIN_BUCKETS) {
+      workers = table->max_size / HASH_TABLE_BUILD_MIN_BUCKETS;
+    }
 
-  hash_table_rehash(table, old_buckets, old_max_size, old_max_size_shift);
+    if (workers > 1) {
+      return hash_table_build_parallel(table, pairs, n, workers);
+    }
+  }
 
-  // We don't need the old buckets any more.
-  free(old_buckets);
+#else
+  (void) threads;
+#endif
 
-  return true;
+  return hash_table_add_batch(table, pairs, n);
 }
 
-static void hash_table_entry_free(struct hash_table_entry *entry) {
-  free(entry->key);
-  free(entry);
-}
+size_t hash_table_get_size(const struct hash_table *table) {
 
-static struct hash_table_entry **hash_table_buckets_alloc(
-  struct hash_table *table
-) {
-  return calloc(
-    sizeof(*table->buckets),
+  if (table->old) {
+    return table->curr_size + table->old->curr_size;
+  }
 
-    /*
-     * Adding on table->max_size_shift (which is also the maximum
-     * probe count) means that we never have to worry about wrapping
-     * from the end of the array back to the beginning during probing.
-    */
-    table->max_size + table->max_size_shift
-  );
+  return table->curr_size;
 }
 
-static struct hash_table_entry *hash_table_entry_create(
-  const char *key,
-  void *data
+static char *hash_table_interner_acquire(
+  struct hash_table_interner *interner,
+  const struct hash_table_key *key
 ) {
 
-  struct hash_table_entry *entry = malloc(sizeof(*entry));
-  if (!entry) {
-    return NULL;
-  }
-  memset(entry, 0, sizeof(*entry));
-
-  entry->hash = djb2_hash(key);
-  entry->data = data;
-
-  size_t key_length = strlen(key) + 1;
+  struct hash_table *keys = interner->keys;
 
-  // Make a copy of the key.
-  entry->key = malloc(key_length);
-  if (!entry->key) {
-    free(entry);
+  if (hash_table_should_resize_up_factor(keys) && !hash_table_grow(keys)) {
     return NULL;
   }
-  strncpy(entry->key, key, key_length);
 
-  return entry;
-}
+  // The interner hashes keys with its own seed.
+  struct hash_table_key lookup = *key;
+  lookup.hash = hash_table_hash_key(keys, key->value, key->length);
 
-static bool hash_table_should_resize_up_factor(
-  const struct hash_table *table
-) {
+  size_t position;
 
-  // Add one to check if we have room for the item we might be
-  // adding.
-  return table->curr_size + 1 >
-    table->max_size * HASH_TABLE_LOAD_FACTOR_INCREASE;
-}
+  if (hash_table_find(keys, &lookup, &position)) {
 
-static bool hash_table_should_resize_down_factor(
-  const struct hash_table *table
-) {
+    struct hash_table_entry *entry = &keys->buckets.entries[position];
+    entry->data = (void *) ((uintptr_t) entry->data + 1);
 
-  // Never go lower than the minimum shift.
-  if (table->max_size_shift <= HASH_TABLE_INITIAL_SHIFT) {
-    return false;
+    return hash_table_entry_get_key_pointer(entry);
   }
 
-  return table->curr_size - 1 <
-    table->max_size * HASH_TABLE_LOAD_FACTOR_DECREASE;
-}
-
-struct hash_table *hash_table_create() {
+  struct hash_table_entry entry;
+  if (!hash_table_entry_init(&entry, &lookup, (void *) 1)) {
+    return NULL;
+  }
 
-  struct hash_table *table = malloc(sizeof(*table));
-  if (!table) {
-    return NULL;   
+  // Make a copy of the key, adding a terminator (the key may not have
+  // one).
+  char *copy = rash_slab_alloc(&interner->slab, key->length + 1);
+  if (!copy) {
+    return NULL;
   }
-  memset(table, 0, sizeof(*table));
-  
-  table->max_size_shift = HASH_TABLE_INITIAL_SHIFT;
-  table->max_size = 1 << HASH_TABLE_INITIAL_SHIFT;
 
-  table->buckets = hash_table_buckets_alloc(table);
+  memcpy(copy, key->value, key->length);
+  copy[key->length] = '\0';
+
+  hash_table_entry_set_key_pointer(&entry, copy);
+  hash_table_entry_set_key_owner(&entry, HASH_TABLE_KEY_BORROWED);
 
-  if (!table->buckets) {
-    free(table);
+  if (!hash_table_insert(keys, entry)) {
+    rash_slab_free(&interner->slab, copy, key->length + 1);
     return NULL;
   }
-  
-  return table;
+
+  return copy;
 }
 
-void hash_table_free_callback(struct hash_table *table, void (*cb)(void *)) {
+static void hash_table_interner_release(
+  struct hash_table_interner *interner,
+  const char *key,
+  size_t length
+) {
 
-  size_t i = 0;
+  struct hash_table *keys = interner->keys;
 
-  HASH_TABLE_ITERATE_TO_END(table, i) {
-  
-    struct hash_table_entry *entry = table->buckets[i];
+  struct hash_table_key lookup;
+  lookup.value = key;
+  lookup.length = length;
+  lookup.hash = hash_table_hash_key(keys, key, length);
 
-    if (entry) {
+  size_t position;
 
-      if (cb) {
-        cb(entry->data);
-      }
+  // Every key given out is in the interner.
+  hash_table_find(keys, &lookup, &position);
 
-      hash_table_entry_free(entry);
-    }
-  }
+  struct hash_table_entry *entry = &keys->buckets.entries[position];
+  entry->data = (void *) ((uintptr_t) entry->data - 1);
 
-  free(table->buckets);
-  free(table);
+  if (!entry->data) {
+    rash_slab_free(
+      &interner->slab,
+      hash_table_entry_get_key_pointer(entry),
+      length + 1
+    );
+    hash_table_remove_from_position(keys, position);
+  }
 }
 
-void hash_table_free(struct hash_table *table) {
-  hash_table_free_callback(table, NULL);
+struct hash_table_interner *hash_table_interner_create() {
+  return hash_table_interner_create_ex(NULL);
 }
 
-bool hash_table_add(struct hash_table *table, const char *key, void *data) {
+struct hash_table_interner *hash_table_interner_create_ex(
+  const struct hash_table_allocator *allocator
+) {
 
-  struct hash_table_entry *new_entry = hash_table_entry_create(key, data);
-  if (!new_entry) {
-    goto error_create;
-  }
+  struct hash_table_allocator interner_allocator;
+  interner_allocator.alloc = hash_table_default_alloc;
+  interner_allocator.free = hash_table_default_free;
+  interner_allocator.context = NULL;
 
-  if (hash_table_should_resize_up_factor(table)) {
-    if (!hash_table_resize(table, HASH_TABLE_RESIZE_INCREMENT)) {
-      goto error_resize;
-    }
+  if (allocator) {
+    interner_allocator = *allocator;
   }
 
-  if (!hash_table_insert(table, new_entry)) {
-    goto error_resize;
-  }
+  struct hash_table_interner *interner = interner_allocator.alloc(
+    sizeof(*interner),
+    interner_allocator.context
+  );
 
-  return true;
+  if (!interner) {
+    return NULL;
+  }
 
-// Don't bother undoing a resize if we failed to add an
-// entry - it will probably just cause more problems!
-error_resize:
-  hash_table_entry_free(new_entry);
-error_create:
-  return false;
-}
+  interner->allocator = interner_allocator;
 
-bool hash_table_remove(struct hash_table *table, const char *key) {
+  struct hash_table_options options = {0};
+  options.allocator = &interner->allocator;
 
-  if (hash_table_should_resize_down_factor(table)) {
-    if (!hash_table_resize(table, -HASH_TABLE_RESIZE_INCREMENT)) {
-      return false;
-    }
-  }
-  
-  uint8_t probe_count = 0;
-  size_t position = hash_table_get_position(table, key);
-  
-  // Find the position of the element (might not actually be
-  // at the desired position if we've done linear probing).
-  HASH_TABLE_ITERATE_TO_NEXT(table, key, position, probe_count);
- 
-  // Have we found the element? 
-  if (
-    !hash_table_is_next_found(table, probe_count) ||
-    !table->buckets[position]
-  ) {
-    return false;
+  interner->keys = hash_table_create_ex(&options);
+  if (!interner->keys) {
+    interner_allocator.free(
+      interner,
+      sizeof(*interner),
+      interner_allocator.context
+    );
+    return NULL;
   }
-  
-  // Free the memory then remove it.
-  hash_table_entry_free(table->buckets[position]);
-
-  return hash_table_remove_from_position(table, position);
-}
-
-void *hash_table_get(const struct hash_table *table, const char *key) {
 
-  size_t position = hash_table_get_position(table, key);
-  uint8_t probe_count = 0;
+  rash_slab_init(&interner->slab, &interner->allocator);
 
-  HASH_TABLE_ITERATE_TO_NEXT(table, key, position, probe_count);
+  return interner;
+}
 
-  if (!hash_table_is_next_found(table, probe_count)) {
-    return NULL;
-  }
+void hash_table_interner_free(struct hash_table_interner *interner) {
 
-  struct hash_table_entry *entry = table->buckets[position];
+  rash_slab_destroy(&interner->slab);
+  hash_table_free(interner->keys);
 
-  return entry ? entry->data : NULL;
+  // The interner is freed with a copy of the allocator, as the
+  // allocator is part of the interner.
+  struct hash_table_allocator allocator = interner->allocator;
+  allocator.free(interner, sizeof(*interner), allocator.context);
 }
 
-size_t hash_table_get_size(const struct hash_table *table) {
-  return table->curr_size;
+size_t hash_table_interner_get_size(
+  const struct hash_table_interner *interner
+) {
+  return hash_table_get_size(interner->keys);
 }
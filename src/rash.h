@@ -5,6 +5,8 @@
 #ifndef HASH_TABLE_H_
 #define HASH_TABLE_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 /*
@@ -12,11 +14,117 @@
 */
 struct hash_table;
 
+/*
+ * Keys shared between hash tables. Each distinct key is stored once,
+ * however many tables (and entries) use it (short keys are stored
+ * within the tables themselves, so are never shared). An interner must be freed
+ * after every table using it, and tables sharing an interner must not
+ * be used by different threads at the same time.
+*/
+struct hash_table_interner;
+
+/*
+ * Functions used by a hash table to get and give back memory.
+*/
+struct hash_table_allocator {
+
+  // Allocate memory of a given size (suitably aligned for any type).
+  // Returns NULL if there is no memory.
+  void *(*alloc)(size_t size, void *context);
+
+  // Free memory given by alloc, along with the size it was allocated
+  // with.
+  void (*free)(void *memory, size_t size, void *context);
+
+  // Passed to the above functions.
+  void *context;
+};
+
+/*
+ * Options used to create a hash table. Zero initialise the structure
+ * and then set the fields that are needed.
+*/
+struct hash_table_options {
+
+  // Function used to hash a key of a given length (excluding the
+  // terminator). NULL means the built in hash function is used, with a
+  // random seed for each table. The seed changes which keys collide,
+  // so keys picked to collide in one table (or process) don't collide
+  // in another, and a large table whose keys collide anyway picks a new
+  // seed. It does not protect against keys picked by watching how the
+  // table itself behaves (such as timing its operations). None of this
+  // applies to a table with its own hash function.
+  size_t (*hash)(const char *key, size_t length, void *context);
+
+  // Function used to determine if two keys are equal. It is only
+  // called for keys whose hashes match. NULL means keys are compared
+  // byte by byte.
+  bool (*equal)(
+    const char *key1,
+    size_t length1,
+    const char *key2,
+    size_t length2,
+    void *context
+  );
+
+  // Passed to the above functions.
+  void *context;
+
+  // Number of elements the table should be able to hold before it
+  // first needs to grow.
+  size_t capacity;
+
+  // Grow without stopping to move every element at once. The old
+  // elements are kept alongside the new ones and moved across a few
+  // at a time by later adds and removes (lookups check both), which
+  // bounds the time taken by any one call at the cost of slightly
+  // slower operations while the table grows.
+  bool incremental;
+
+  // Store the keys in an interner (shared with other tables) rather
+  // than copying them into the table. NULL means keys are copied.
+  struct hash_table_interner *interner;
+
+  // Allocator used for all of the memory owned by the table (including
+  // the table itself). It is copied, but its context must outlive the
+  // table. NULL means malloc and free are used.
+  const struct hash_table_allocator *allocator;
+
+  // Bucket arrays of at least this many bytes are given their own
+  // memory mapping, backed by huge pages where the system allows it
+  // (which saves TLB misses when probing very large tables). Zero
+  // means this is never done. Only used on POSIX systems, and only if
+  // no allocator is given.
+  size_t huge_page_threshold;
+};
+
 /*
  * Create a hash table.
 */
 struct hash_table *hash_table_create();
 
+/*
+ * Create a hash table with the given options (which may be NULL
+ * to use the defaults).
+*/
+struct hash_table *hash_table_create_ex(
+  const struct hash_table_options *options
+);
+
+/*
+ * Create a hash table which can hold (at least) the given number of
+ * elements without growing.
+*/
+struct hash_table *hash_table_create_with_capacity(size_t capacity);
+
+/*
+ * Grow the hash table (if needed) so that it can hold the given
+ * number of elements in total without growing again. Every entry
+ * (including any not yet moved by an incremental resize) is moved
+ * once, without being hashed again.
+*/
+bool hash_table_reserve(struct hash_table *table, size_t capacity);
+
 /*
  * Free a hash table, calling a callback function for each element
  * in the table.
@@ -30,23 +138,240 @@ void hash_table_free_callback(struct hash_table *table, void (*cb)(void *));
 void hash_table_free(struct hash_table *table);
 
 /*
- * Add data, associated with a given key to the hash table.
+ * Add data, associated with a given key to the hash table. If the key
+ * is already in the table, its data is replaced in place (without any
+ * allocation).
 */
 bool hash_table_add(struct hash_table *table, const char *key, void *data);
 
+/*
+ * The same as hash_table_add, but the key is given as a pointer and a
+ * length, so it doesn't need a terminator (and may contain zero
+ * bytes). The same goes for the other functions ending in _n.
+*/
+bool hash_table_add_n(
+  struct hash_table *table,
+  const char *key,
+  size_t length,
+  void *data
+);
+
+/*
+ * The same as hash_table_add, but the data previously associated with
+ * the key (or NULL if the key was not in the table) is stored in
+ * previous (unless it is NULL).
+*/
+bool hash_table_replace(
+  struct hash_table *table,
+  const char *key,
+  void *data,
+  void **previous
+);
+
+/*
+ * The same as hash_table_add, but the table stores the key it is given
+ * rather than a copy of it, so the key must not change or be freed
+ * while it is in the table. Keys short enough to be stored inside
+ * their entry are still copied.
+*/
+bool hash_table_add_borrowed(
+  struct hash_table *table,
+  const char *key,
+  void *data
+);
+
+/*
+ * The same as hash_table_add, but the table takes over the key it is
+ * given (which must have been allocated, with the size of the key
+ * including its terminator, from the allocator of the table or with
+ * malloc if it doesn't have one). The table frees the key once it is
+ * no longer needed, which may be straight away (if the key is already
+ * in the table, or short enough to be stored inside its entry). If
+ * adding fails, the key still belongs to the caller.
+*/
+bool hash_table_add_owned(struct hash_table *table, char *key, void *data);
+
+/*
+ * Get a pointer to the data associated with a key, adding the key
+ * (with NULL data) if it is not in the table. Whether the key was
+ * added is stored in inserted (unless it is NULL). Updating the data
+ * of an existing key this way only looks it up once, and never
+ * allocates. The pointer is only valid until the table is next
+ * changed. Returns NULL if there is no memory.
+*/
+void **hash_table_get_or_insert(
+  struct hash_table *table,
+  const char *key,
+  bool *inserted
+);
+
+/*
+ * A key, and the data to associate with it.
+*/
+struct hash_table_pair {
+  const char *key;
+  void *data;
+};
+
+/*
+ * Add N pairs to the hash table, in order (so a later pair with the
+ * same key as an earlier one replaces it). The table is grown up front
+ * to fit every pair, rather than as each is added. If this fails then
+ * some of the pairs may have been added.
+*/
+bool hash_table_add_batch(
+  struct hash_table *table,
+  const struct hash_table_pair *pairs,
+  size_t n
+);
+
+/*
+ * The same as hash_table_add_batch, but for filling an empty table
+ * using a number of threads. The table is split into ranges of
+ * buckets, and each thread fills its own range with the pairs that
+ * hash into it, without any locking. If a key is given more than once
+ * then only one of its pairs is kept, but which one is unspecified.
+ * The hash and equality functions (if any) must be safe to call from
+ * several threads at once.
+ *
+ * Threads are only used if the library was built with them, the table
+ * is empty, has no interner and uses the default allocator, and there
+ * are enough pairs to be worth it. Otherwise this is the same as
+ * hash_table_add_batch.
+*/
+bool hash_table_add_parallel(
+  struct hash_table *table,
+  const struct hash_table_pair *pairs,
+  size_t n,
+  unsigned int threads
+);
+
 /*
  * Remove data, associated with a given key from the hash table.
 */
 bool hash_table_remove(struct hash_table *table, const char *key);
 
+/*
+ * The same as hash_table_remove, but the key is given as a pointer and
+ * a length (see hash_table_add_n).
+*/
+bool hash_table_remove_n(
+  struct hash_table *table,
+  const char *key,
+  size_t length
+);
+
 /*
  * Get data, associated with a given key from the hash table.
 */
 void *hash_table_get(const struct hash_table *table, const char *key);
 
+/*
+ * The same as hash_table_get, but the key is given as a pointer and a
+ * length (see hash_table_add_n).
+*/
+void *hash_table_get_n(
+  const struct hash_table *table,
+  const char *key,
+  size_t length
+);
+
+/*
+ * Get the data associated with each of N keys, storing it (or NULL if
+ * the key is not in the table) at the same index of the data array.
+ * The same as calling hash_table_get for each key, but much faster for
+ * tables that don't fit in the cache, as the memory accesses of
+ * several keys are overlapped.
+*/
+void hash_table_get_batch(
+  const struct hash_table *table,
+  const char *const *keys,
+  size_t n,
+  void **data
+);
+
 /*
  * Get the current number of elements currently stored in the hash table.
 */
 size_t hash_table_get_size(const struct hash_table *table);
 
+/*
+ * Create an interner, which keys can be shared through (see
+ * hash_table_options).
+*/
+struct hash_table_interner *hash_table_interner_create();
+
+/*
+ * Create an interner which gets all of its memory from an allocator
+ * (which may be NULL to use malloc and free). The allocator is copied,
+ * but its context must outlive the interner.
+*/
+struct hash_table_interner *hash_table_interner_create_ex(
+  const struct hash_table_allocator *allocator
+);
+
+/*
+ * Free an interner. Every table using it must have been freed.
+*/
+void hash_table_interner_free(struct hash_table_interner *interner);
+
+/*
+ * Get the number of distinct keys stored in an interner.
+*/
+size_t hash_table_interner_get_size(
+  const struct hash_table_interner *interner
+);
+
+/*
+ * Structure which represents a hash table with 64 bit integer keys.
+ * The keys are stored in the table itself, so there is nothing to
+ * copy or compare other than the integers. Otherwise these tables
+ * behave the same as the ones with string keys (without any of the
+ * options).
+*/
+struct hash_table_u64;
+
+/*
+ * Create a hash table with 64 bit integer keys.
+*/
+struct hash_table_u64 *hash_table_u64_create();
+
+/*
+ * Create a hash table with 64 bit integer keys which can hold (at
+ * least) the given number of elements without growing.
+*/
+struct hash_table_u64 *hash_table_u64_create_with_capacity(size_t capacity);
+
+/*
+ * Free a hash table with 64 bit integer keys (the caller must free
+ * any memory passed to be stored).
+*/
+void hash_table_u64_free(struct hash_table_u64 *table);
+
+/*
+ * Add data, associated with a given key, replacing the data of the key
+ * if it is already in the table.
+*/
+bool hash_table_u64_add(
+  struct hash_table_u64 *table,
+  uint64_t key,
+  void *data
+);
+
+/*
+ * Remove data, associated with a given key.
+*/
+bool hash_table_u64_remove(struct hash_table_u64 *table, uint64_t key);
+
+/*
+ * Get data, associated with a given key (or NULL if the key is not in
+ * the table).
+*/
+void *hash_table_u64_get(const struct hash_table_u64 *table, uint64_t key);
+
+/*
+ * Get the number of elements stored in the table.
+*/
+size_t hash_table_u64_get_size(const struct hash_table_u64 *table);
+
 #endif
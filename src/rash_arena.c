@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2021 Kian Cross
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "rash_arena.h"
+
+/*
+ * Add a new block, with room for (at least) the given size.
+*/
+static bool rash_arena_add_block(struct rash_arena *arena, size_t size);
+
+/*
+ * Get the number of unused bytes at the end of the newest block.
+*/
+static size_t rash_arena_get_available(const struct rash_arena *arena);
+
+static bool rash_arena_add_block(struct rash_arena *arena, size_t size) {
+
+  size_t block_size = RASH_ARENA_MIN_BLOCK_SIZE;
+
+  if (arena->blocks) {
+    block_size = arena->blocks->size * 2;
+
+    if (block_size > RASH_ARENA_MAX_BLOCK_SIZE) {
+      block_size = RASH_ARENA_MAX_BLOCK_SIZE;
+    }
+  }
+
+  if (block_size < size) {
+    block_size = size;
+  }
+
+  const struct hash_table_allocator *allocator = arena->allocator;
+
+  struct rash_arena_block *block = allocator->alloc(
+    sizeof(*block) + block_size,
+    allocator->context
+  );
+
+  if (!block) {
+    return false;
+  }
+
+  block->next = arena->blocks;
+  block->size = block_size;
+  block->used = 0;
+
+  arena->blocks = block;
+
+  return true;
+}
+
+static size_t rash_arena_get_available(const struct rash_arena *arena) {
+
+  if (!arena->blocks) {
+    return 0;
+  }
+
+  return arena->blocks->size - arena->blocks->used;
+}
+
+void rash_arena_init(
+  struct rash_arena *arena,
+  const struct hash_table_allocator *allocator
+) {
+  memset(arena, 0, sizeof(*arena));
+  arena->allocator = allocator;
+}
+
+void *rash_arena_alloc(struct rash_arena *arena, size_t size) {
+
+  // The rest of the newest block is wasted if the allocation doesn't
+  // fit, which is fine as long as allocations are small compared to
+  // the blocks.
+  if (!rash_arena_reserve(arena, size)) {
+    return NULL;
+  }
+
+  struct rash_arena_block *block = arena->blocks;
+
+  char *memory = (char *) (block + 1) + block->used;
+  block->used += size;
+  arena->live += size;
+
+  return memory;
+}
+
+void rash_arena_free(struct rash_arena *arena, size_t size) {
+  arena->live -= size;
+  arena->dead += size;
+}
+
+bool rash_arena_reserve(struct rash_arena *arena, size_t size) {
+
+  if (rash_arena_get_available(arena) >= size) {
+    return true;
+  }
+
+  return rash_arena_add_block(arena, size);
+}
+
+void rash_arena_merge(struct rash_arena *arena, struct rash_arena *other) {
+
+  if (other->blocks) {
+
+    struct rash_arena_block *last = other->blocks;
+    while (last->next) {
+      last = last->next;
+    }
+
+    // Put the blocks after the newest one, so that it stays the one
+    // allocations come from.
+    if (arena->blocks) {
+      last->next = arena->blocks->next;
+      arena->blocks->next = other->blocks;
+    } else {
+      arena->blocks = other->blocks;
+    }
+  }
+
+  arena->live += other->live;
+  arena->dead += other->dead;
+
+  rash_arena_init(other, other->allocator);
+}
+
+void rash_arena_destroy(struct rash_arena *arena) {
+
+  const struct hash_table_allocator *allocator = arena->allocator;
+  struct rash_arena_block *block = arena->blocks;
+
+  while (block) {
+    struct rash_arena_block *next = block->next;
+    allocator->free(block, sizeof(*block) + block->size, allocator->context);
+    block = next;
+  }
+
+  rash_arena_init(arena, allocator);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2021 Kian Cross
+ */
+
+#ifndef RASH_ARENA_H_
+#define RASH_ARENA_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "rash.h"
+
+/*
+ * Sizes of the blocks taken from the allocator. The first block is the
+ * smallest size, and each one after is double the size of the one
+ * before, up to the largest size (unless a bigger allocation needs
+ * more).
+*/
+#define RASH_ARENA_MIN_BLOCK_SIZE 256
+#define RASH_ARENA_MAX_BLOCK_SIZE (64 * 1024)
+
+/*
+ * A block of memory (which follows the header).
+*/
+struct rash_arena_block {
+  struct rash_arena_block *next;
+
+  // Size of the memory following the header, and how much of it has
+  // been handed out.
+  size_t size;
+  size_t used;
+};
+
+/*
+ * Hands out memory (without any alignment) by appending it to the
+ * newest block. There is no per allocation overhead, but freed memory
+ * is only counted, and never reused. Once enough is dead the owner
+ * should copy what is still live into a new arena (see
+ * rash_arena_reserve).
+*/
+struct rash_arena {
+
+  // Where the blocks come from.
+  const struct hash_table_allocator *allocator;
+
+  // Newest block first.
+  struct rash_arena_block *blocks;
+
+  // Bytes handed out which have not been freed.
+  size_t live;
+
+  // Bytes which have been freed (but can not be used again).
+  size_t dead;
+};
+
+/*
+ * Initialise an empty arena, which takes memory from an allocator
+ * (which must outlive it).
+*/
+void rash_arena_init(
+  struct rash_arena *arena,
+  const struct hash_table_allocator *allocator
+);
+
+/*
+ * Allocate memory of a given size. Returns NULL if there is no
+ * memory.
+*/
+void *rash_arena_alloc(struct rash_arena *arena, size_t size);
+
+/*
+ * Record that memory of a given size, which came from the arena, is no
+ * longer used.
+*/
+void rash_arena_free(struct rash_arena *arena, size_t size);
+
+/*
+ * Make sure allocations totalling the given size can be made without
+ * needing any more memory (so they can not fail). Returns false if
+ * there is no memory.
+*/
+bool rash_arena_reserve(struct rash_arena *arena, size_t size);
+
+/*
+ * Move all the memory of another arena (which must use the same
+ * allocator) into this one, leaving the other one empty. Allocations
+ * carry on from the newest block of this arena.
+*/
+void rash_arena_merge(struct rash_arena *arena, struct rash_arena *other);
+
+/*
+ * Free all the memory owned by the arena.
+*/
+void rash_arena_destroy(struct rash_arena *arena);
+
+#endif
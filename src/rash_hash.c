@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) 2021 Kian Cross
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * The CRC32C hash needs the 64 bit SSE4.2 CRC32 instruction. It is
+ * compiled for SSE4.2 regardless of the flags used for the rest of the
+ * library, and only used if the CPU supports it.
+*/
+#if (defined(__x86_64__) && defined(__GNUC__)) || defined(_M_X64)
+#define RASH_HASH_HAVE_CRC32C
+
+#if defined(_MSC_VER)
+// Also provides _umul128.
+#include <intrin.h>
+#include <nmmintrin.h>
+#define RASH_HASH_TARGET_SSE42
+#else
+#include <nmmintrin.h>
+#define RASH_HASH_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+#include "rash_hash.h"
+
+/*
+ * Constants used by the wyhash algorithm. Magic numbers are part of
+ * the algorithm and represent nothing specifically.
+*/
+static const uint64_t rash_hash_wy_secret[4] = {
+  0x2d358dccaa6c78a5llu,
+  0x8bb84b93962eacc9llu,
+  0x4b33a62ed433d4a3llu,
+  0x4d5a2da51de1aa47llu
+};
+
+/*
+ * Read (unaligned) integers of various sizes.
+*/
+static uint64_t rash_hash_read64(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint64_t rash_hash_read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+/*
+ * Reads 1 to 3 bytes (length must not be zero).
+*/
+static uint64_t rash_hash_read_small(const uint8_t *p, size_t length) {
+  return
+    ((uint64_t) p[0] << 16) |
+    ((uint64_t) p[length >> 1] << 8) |
+    p[length - 1];
+}
+
+/*
+ * Multiplies a and b, storing the bottom 64 bits of the result
+ * in a and the top 64 bits in b.
+*/
+static void rash_hash_multiply(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t result = (__uint128_t) *a * *b;
+  *a = (uint64_t) result;
+  *b = (uint64_t) (result >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  *a = _umul128(*a, *b, b);
+#else
+  uint64_t a_high = *a >> 32, a_low = (uint32_t) *a;
+  uint64_t b_high = *b >> 32, b_low = (uint32_t) *b;
+
+  uint64_t high = a_high * b_high;
+  uint64_t middle0 = a_high * b_low;
+  uint64_t middle1 = b_high * a_low;
+  uint64_t low = a_low * b_low;
+
+  uint64_t t = low + (middle0 << 32);
+  uint64_t carry = t < low;
+
+  low = t + (middle1 << 32);
+  carry += low < t;
+  high += (middle0 >> 32) + (middle1 >> 32) + carry;
+
+  *a = low;
+  *b = high;
+#endif
+}
+
+/*
+ * Multiplies a and b, folding the 128 bit result into 64 bits.
+*/
+static uint64_t rash_hash_mix(uint64_t a, uint64_t b) {
+  rash_hash_multiply(&a, &b);
+  return a ^ b;
+}
+
+// Taken from:
+// http://www.cse.yorku.ca/~oz/hash.html
+// Magic numbers are part of the algorithm and represent nothing
+// specifically.
+uint64_t rash_hash_djb2(const void *data, size_t length, uint64_t seed) {
+
+  const uint8_t *p = data;
+  uint64_t hash = 5381 ^ seed;
+
+  for (size_t i = 0; i < length; i++) {
+    hash = ((hash << 5) + hash) + p[i];
+  }
+
+  return hash;
+}
+
+// Based on wyhash (final version 4), which is released into the
+// public domain:
+// https://github.com/wangyi-fudan/wyhash
+uint64_t rash_hash_wy(const void *data, size_t length, uint64_t seed) {
+
+  const uint8_t *p = data;
+  const uint64_t *secret = rash_hash_wy_secret;
+  uint64_t a, b;
+
+  seed ^= rash_hash_mix(seed ^ secret[0], secret[1]);
+
+  if (length <= 16) {
+
+    if (length >= 4) {
+
+      // Two (possibly overlapping) reads from each end cover
+      // every byte.
+      size_t offset = (length >> 3) << 2;
+      a = (rash_hash_read32(p) << 32) | rash_hash_read32(p + offset);
+      b = (rash_hash_read32(p + length - 4) << 32) |
+        rash_hash_read32(p + length - 4 - offset);
+
+    } else if (length > 0) {
+      a = rash_hash_read_small(p, length);
+      b = 0;
+
+    } else {
+      a = b = 0;
+    }
+
+  } else {
+
+    size_t remaining = length;
+
+    // Three independent lanes, so that the multiplications
+    // can run in parallel.
+    if (remaining > 48) {
+
+      uint64_t seed1 = seed;
+      uint64_t seed2 = seed;
+
+      do {
+        seed = rash_hash_mix(
+          rash_hash_read64(p) ^ secret[1],
+          rash_hash_read64(p + 8) ^ seed
+        );
+        seed1 = rash_hash_mix(
+          rash_hash_read64(p + 16) ^ secret[2],
+          rash_hash_read64(p + 24) ^ seed1
+        );
+        seed2 = rash_hash_mix(
+          rash_hash_read64(p + 32) ^ secret[3],
+          rash_hash_read64(p + 40) ^ seed2
+        );
+
+        p += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+
+      seed ^= seed1 ^ seed2;
+    }
+
+    while (remaining > 16) {
+      seed = rash_hash_mix(
+        rash_hash_read64(p) ^ secret[1],
+        rash_hash_read64(p + 8) ^ seed
+      );
+
+      p += 16;
+      remaining -= 16;
+    }
+
+    // The last 16 bytes (overlapping with bytes that have already
+    // been consumed if needed).
+    a = rash_hash_read64(p + remaining - 16);
+    b = rash_hash_read64(p + remaining - 8);
+  }
+
+  a ^= secret[1];
+  b ^= seed;
+  rash_hash_multiply(&a, &b);
+
+  return rash_hash_mix(a ^ secret[0] ^ length, b ^ secret[1]);
+}
+
+bool rash_hash_crc32c_supported(void) {
+#if defined(RASH_HASH_HAVE_CRC32C) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 20)) != 0;
+#elif defined(RASH_HASH_HAVE_CRC32C)
+  return __builtin_cpu_supports("sse4.2");
+#else
+  return false;
+#endif
+}
+
+#ifdef RASH_HASH_HAVE_CRC32C
+
+RASH_HASH_TARGET_SSE42
+uint64_t rash_hash_crc32c(const void *data, size_t length, uint64_t seed) {
+
+  const uint8_t *p = data;
+
+  // Two independent CRCs, so that the instructions (which have a
+  // latency of a few cycles) can overlap.
+  uint64_t low = (uint32_t) seed;
+  uint64_t high = (seed >> 32) ^ length;
+
+  // A single 32 bit CRC of keys of up to 8 bytes would only give 2^32
+  // different hashes, so the word (which is the whole key) also goes
+  // into the other lane as it is.
+  if (length <= 8) {
+
+    uint64_t word = 0;
+
+    if (length >= 4) {
+      word = (rash_hash_read32(p) << 32) | rash_hash_read32(p + length - 4);
+    } else if (length > 0) {
+      word = rash_hash_read_small(p, length);
+    }
+
+    low = _mm_crc32_u64(low, word);
+    high ^= word;
+
+  } else {
+
+    while (length >= 16) {
+      low = _mm_crc32_u64(low, rash_hash_read64(p));
+      high = _mm_crc32_u64(high, rash_hash_read64(p + 8));
+
+      p += 16;
+      length -= 16;
+    }
+
+    if (length >= 8) {
+      low = _mm_crc32_u64(low, rash_hash_read64(p));
+
+      p += 8;
+      length -= 8;
+    }
+
+    // Up to 7 bytes left, read the same way as rash_hash_wy does.
+    if (length >= 4) {
+      high = _mm_crc32_u64(
+        high,
+        (rash_hash_read32(p) << 32) | rash_hash_read32(p + length - 4)
+      );
+
+    } else if (length > 0) {
+      high = _mm_crc32_u64(high, rash_hash_read_small(p, length));
+    }
+  }
+
+  // A CRC is linear, so finish the same way as rash_hash_wy, with two
+  // rounds of multiplication to spread the bits over the result.
+  const uint64_t *secret = rash_hash_wy_secret;
+
+  low ^= secret[1];
+  high ^= seed;
+  rash_hash_multiply(&low, &high);
+
+  return rash_hash_mix(low ^ secret[0], high ^ secret[1]);
+}
+
+#else
+
+uint64_t rash_hash_crc32c(const void *data, size_t length, uint64_t seed) {
+
+  // Never selected (see rash_hash_crc32c_supported).
+  return rash_hash_wy(data, length, seed);
+}
+
+#endif
+
+#if defined(RASH_HASH_WEAK)
+
+uint64_t rash_hash_weak(const void *data, size_t length, uint64_t seed) {
+
+  if (!length || length > 3 || seed % 4 == 0) {
+    return rash_hash_wy(data, length, seed);
+  }
+
+  // For 3 in 4 seeds, the bottom bits of the last byte of short keys
+  // are ignored, so keys that only differ there (such as "10" to "13")
+  // collide. There are only a few of these keys, in groups of at most
+  // 4, so they are mostly seen by small tables (and growing a table
+  // always fits them in eventually).
+  uint8_t last = ((const uint8_t *) data)[length - 1] & ~3u;
+
+  return rash_hash_wy(data, length - 1, seed + last);
+}
+
+#endif
+
+rash_hash_function rash_hash_select(void) {
+
+#if defined(RASH_HASH_WEAK)
+  return rash_hash_weak;
+#else
+  if (rash_hash_crc32c_supported()) {
+    return rash_hash_crc32c;
+  }
+
+  return rash_hash_wy;
+#endif
+}
+
+rash_hash_function rash_hash_select_seeded(void) {
+
+#if defined(RASH_HASH_WEAK)
+  return rash_hash_weak;
+#else
+  return rash_hash_wy;
+#endif
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2021 Kian Cross
+ */
+
+#ifndef RASH_HASH_H_
+#define RASH_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Signature shared by all of the string hash functions. The seed
+ * changes the hash produced for every key.
+*/
+typedef uint64_t (*rash_hash_function)(
+  const void *data,
+  size_t length,
+  uint64_t seed
+);
+
+/*
+ * The djb2 hash (one byte per iteration). Only kept for comparison.
+*/
+uint64_t rash_hash_djb2(const void *data, size_t length, uint64_t seed);
+
+/*
+ * A wyhash based hash, which consumes 8 (or 16) bytes per step and
+ * mixes them with a 64x64 -> 128 bit multiplication.
+*/
+uint64_t rash_hash_wy(const void *data, size_t length, uint64_t seed);
+
+/*
+ * Determine if rash_hash_crc32c can be used on this CPU.
+*/
+bool rash_hash_crc32c_supported(void);
+
+/*
+ * A hash built on the SSE4.2 CRC32C instruction. Must only be called
+ * if rash_hash_crc32c_supported returns true.
+*/
+uint64_t rash_hash_crc32c(const void *data, size_t length, uint64_t seed);
+
+/*
+ * Select the best hash function for the CPU we are running on.
+*/
+rash_hash_function rash_hash_select(void);
+
+/*
+ * Select the best hash function whose collisions depend on the seed,
+ * which is the one used by tables. A CRC is linear, so two keys of the
+ * same length which collide with rash_hash_crc32c do so with every
+ * seed.
+*/
+rash_hash_function rash_hash_select_seeded(void);
+
+#if defined(RASH_HASH_WEAK)
+
+/*
+ * A deliberately weak hash, where groups of keys collide for most
+ * seeds, until a table is reseeded with a seed where they don't. Both
+ * of the selections pick it when RASH_HASH_WEAK is defined, which is
+ * only done to test reseeding.
+*/
+uint64_t rash_hash_weak(const void *data, size_t length, uint64_t seed);
+
+#endif
+
+#endif
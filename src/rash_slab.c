@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2021 Kian Cross
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "rash_slab.h"
+
+/*
+ * Get the size class for a block of a given size, or -1 if it is
+ * too big for any of them.
+*/
+static int rash_slab_get_class(size_t size);
+
+/*
+ * Get the size of the blocks in a given class.
+*/
+static size_t rash_slab_get_block_size(int size_class);
+
+/*
+ * Take a new chunk for a given class.
+*/
+static bool rash_slab_add_chunk(struct rash_slab *slab, int size_class);
+
+static int rash_slab_get_class(size_t size) {
+
+  for (int size_class = 0; size_class < RASH_SLAB_CLASSES; size_class++) {
+    if (size <= rash_slab_get_block_size(size_class)) {
+      return size_class;
+    }
+  }
+
+  return -1;
+}
+
+static size_t rash_slab_get_block_size(int size_class) {
+  return (size_t) 1 << (RASH_SLAB_MIN_SHIFT + size_class);
+}
+
+static bool rash_slab_add_chunk(struct rash_slab *slab, int size_class) {
+
+  size_t size = rash_slab_get_block_size(size_class) * RASH_SLAB_CHUNK_BLOCKS;
+
+  const struct hash_table_allocator *allocator = slab->allocator;
+
+  struct rash_slab_chunk *chunk = allocator->alloc(
+    sizeof(*chunk) + size,
+    allocator->context
+  );
+
+  if (!chunk) {
+    return false;
+  }
+
+  chunk->next = slab->chunks;
+  chunk->size = size;
+  slab->chunks = chunk;
+
+  // The blocks start straight after the header, so they are aligned
+  // well enough to hold the free list pointers.
+  slab->unused_start[size_class] = (char *) (chunk + 1);
+  slab->unused_end[size_class] = slab->unused_start[size_class] + size;
+
+  return true;
+}
+
+void rash_slab_init(
+  struct rash_slab *slab,
+  const struct hash_table_allocator *allocator
+) {
+  memset(slab, 0, sizeof(*slab));
+  slab->allocator = allocator;
+}
+
+void *rash_slab_alloc(struct rash_slab *slab, size_t size) {
+
+  int size_class = rash_slab_get_class(size);
+
+  if (size_class < 0) {
+    return slab->allocator->alloc(size, slab->allocator->context);
+  }
+
+  void *block = slab->free_blocks[size_class];
+
+  // Reuse a freed block if there is one.
+  if (block) {
+    memcpy(&slab->free_blocks[size_class], block, sizeof(void *));
+    return block;
+  }
+
+  if (
+    slab->unused_start[size_class] == slab->unused_end[size_class] &&
+    !rash_slab_add_chunk(slab, size_class)
+  ) {
+    return NULL;
+  }
+
+  block = slab->unused_start[size_class];
+  slab->unused_start[size_class] += rash_slab_get_block_size(size_class);
+
+  return block;
+}
+
+void rash_slab_free(struct rash_slab *slab, void *block, size_t size) {
+
+  int size_class = rash_slab_get_class(size);
+
+  if (size_class < 0) {
+    slab->allocator->free(block, size, slab->allocator->context);
+    return;
+  }
+
+  memcpy(block, &slab->free_blocks[size_class], sizeof(void *));
+  slab->free_blocks[size_class] = block;
+}
+
+void rash_slab_destroy(struct rash_slab *slab) {
+
+  const struct hash_table_allocator *allocator = slab->allocator;
+  struct rash_slab_chunk *chunk = slab->chunks;
+
+  while (chunk) {
+    struct rash_slab_chunk *next = chunk->next;
+    allocator->free(chunk, sizeof(*chunk) + chunk->size, allocator->context);
+    chunk = next;
+  }
+
+  rash_slab_init(slab, allocator);
+}
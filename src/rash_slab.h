@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2021 Kian Cross
+ */
+
+#ifndef RASH_SLAB_H_
+#define RASH_SLAB_H_
+
+#include <stddef.h>
+
+#include "rash.h"
+
+/*
+ * Number of size classes. The smallest blocks are
+ * 2^RASH_SLAB_MIN_SHIFT bytes, and each class is double the size of
+ * the one before it.
+*/
+#define RASH_SLAB_CLASSES 5
+#define RASH_SLAB_MIN_SHIFT 4
+
+/*
+ * Number of blocks in each chunk taken from the allocator.
+*/
+#define RASH_SLAB_CHUNK_BLOCKS 64
+
+/*
+ * A chunk of blocks (which follow the header).
+*/
+struct rash_slab_chunk {
+  struct rash_slab_chunk *next;
+
+  // Size of the memory following the header.
+  size_t size;
+};
+
+/*
+ * Hands out small blocks of memory (in a few fixed sizes), carved out
+ * of larger chunks. Freed blocks are kept on a list for their size, and
+ * reused before any more chunks are taken. Memory is only given back
+ * when the whole slab is freed. Requests too big for any of the sizes
+ * go straight to the allocator.
+*/
+struct rash_slab {
+
+  // Where the chunks (and big blocks) come from.
+  const struct hash_table_allocator *allocator;
+
+  // Freed blocks of each size, linked through their first bytes.
+  void *free_blocks[RASH_SLAB_CLASSES];
+
+  // The part of the newest chunk of each size that has never been
+  // handed out.
+  char *unused_start[RASH_SLAB_CLASSES];
+  char *unused_end[RASH_SLAB_CLASSES];
+
+  // Every chunk (of any size), so that they can be freed.
+  struct rash_slab_chunk *chunks;
+};
+
+/*
+ * Initialise an empty slab, which takes memory from an allocator
+ * (which must outlive it).
+*/
+void rash_slab_init(
+  struct rash_slab *slab,
+  const struct hash_table_allocator *allocator
+);
+
+/*
+ * Allocate a block of (at least) the given size. Returns NULL if
+ * there is no memory.
+*/
+void *rash_slab_alloc(struct rash_slab *slab, size_t size);
+
+/*
+ * Free a block allocated from the slab. The size must be the one
+ * given when it was allocated.
+*/
+void rash_slab_free(struct rash_slab *slab, void *block, size_t size);
+
+/*
+ * Free all the memory owned by the slab, including any blocks which
+ * have not been freed (except those that came straight from the
+ * allocator).
+*/
+void rash_slab_destroy(struct rash_slab *slab);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2021 Kian Cross
+ */
+
+#ifndef RASH_TEMPLATE_H_
+#define RASH_TEMPLATE_H_
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Initial exponent of 2 used for the size of the generated tables.
+*/
+#define RASH_TEMPLATE_INITIAL_SHIFT 4
+
+/*
+ * Load factors at which the generated tables grow and shrink (the same
+ * as the string keyed table).
+*/
+#define RASH_TEMPLATE_LOAD_FACTOR_INCREASE 0.75f
+#define RASH_TEMPLATE_LOAD_FACTOR_DECREASE 0.10f
+
+/*
+ * 2^64 / golden ratio.
+*/
+#define RASH_TEMPLATE_FIBONACCI_MULTIPLIER 11400714819323198485llu
+
+/*
+ * Work out the shift needed for a table to hold a given number of
+ * elements without going over the load factor. Returns zero if the
+ * table could never be that big.
+*/
+static inline uint8_t rash_template_get_shift_for_capacity(size_t capacity) {
+
+  uint8_t shift = RASH_TEMPLATE_INITIAL_SHIFT;
+
+  while (
+    capacity > ((size_t) 1 << shift) * RASH_TEMPLATE_LOAD_FACTOR_INCREASE
+  ) {
+
+    shift++;
+
+    // The size (plus padding) must still fit in a size_t.
+    if (shift >= sizeof(size_t) * 8 - 1) {
+      return 0;
+    }
+  }
+
+  return shift;
+}
+
+/*
+ * Get the desired position of a hash, in a table of a given shift, by
+ * fibonacci hashing it (so the top bits are used).
+*/
+static inline size_t rash_template_get_position(uint64_t hash, uint8_t shift) {
+  return (size_t) (
+    (hash * RASH_TEMPLATE_FIBONACCI_MULTIPLIER) >> (64 - shift)
+  );
+}
+
+/*
+ * Generate a hash table, called `struct name`, with keys of type
+ * key_type and values of type value_type. Both are stored inline in
+ * the slots of the table, and every function is static inline, so the
+ * compiler can specialise the probing for the types (and inline the
+ * hash and equality functions). The functions generated are:
+ *
+ *   struct name *name_create();
+ *   struct name *name_create_with_capacity(size_t capacity);
+ *   void name_free(struct name *table);
+ *   bool name_init(struct name *table, size_t capacity);
+ *   void name_destroy(struct name *table);
+ *   bool name_add(struct name *table, key_type key, value_type value);
+ *   bool name_remove(struct name *table, key_type key);
+ *   value_type *name_get(const struct name *table, key_type key);
+ *   size_t name_get_size(const struct name *table);
+ *
+ * These have the same semantics as the string keyed table (adding an
+ * existing key replaces its value). name_init and name_destroy are the
+ * same as name_create_with_capacity and name_free, for a table which
+ * is embedded in something else (so isn't allocated by itself).
+ * name_get returns a pointer to the value in the table (or NULL if the
+ * key is not in the table), which can be used to update the value
+ * until the table is next changed.
+ *
+ * hash_fn must take a key_type and return a uint64_t, with the top bits
+ * well mixed (or well mixed after fibonacci hashing, as with integer
+ * IDs). eq_fn must take two key_types and return a bool. The tables use
+ * Robin Hood linear probing without wrapping around, just like the
+ * string keyed table, but there is no seed, so if a key can't be placed
+ * within the maximum probe count the table grows instead.
+*/
+#define RASH_DEFINE_TABLE(name, key_type, value_type, hash_fn, eq_fn)          \
+                                                                               \
+  struct name##_entry {                                                        \
+    key_type key;                                                              \
+    value_type value;                                                          \
+  };                                                                           \
+                                                                               \
+  struct name {                                                                \
+    uint8_t max_size_shift;                                                    \
+    size_t max_size;                                                           \
+    size_t curr_size;                                                          \
+                                                                               \
+    /* max_size + max_size_shift slots, so that probing never wraps            \
+       around. dists holds the distance of each entry from its desired         \
+       position plus one (zero is empty), and shares the allocation. */        \
+    struct name##_entry *entries;                                              \
+    uint8_t *dists;                                                            \
+  };                                                                           \
+                                                                               \
+  static inline bool name##_slots_alloc(struct name *table, uint8_t shift) {   \
+                                                                               \
+    size_t max_size = (size_t) 1 << shift;                                     \
+    size_t count = max_size + shift;                                           \
+                                                                               \
+    unsigned char *memory = calloc(                                            \
+      count,                                                                   \
+      sizeof(*table->entries) + sizeof(*table->dists)                          \
+    );                                                                         \
+                                                                               \
+    if (!memory) {                                                             \
+      return false;                                                            \
+    }                                                                          \
+                                                                               \
+    table->max_size_shift = shift;                                             \
+    table->max_size = max_size;                                                \
+    table->entries = (struct name##_entry *) memory;                           \
+    table->dists = memory + count * sizeof(*table->entries);                   \
+                                                                               \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_find(                                              \
+    const struct name *table,                                                  \
+    key_type key,                                                              \
+    size_t *position                                                           \
+  ) {                                                                          \
+                                                                               \
+    size_t current = rash_template_get_position(                               \
+      hash_fn(key),                                                            \
+      table->max_size_shift                                                    \
+    );                                                                         \
+                                                                               \
+    for (                                                                      \
+      uint8_t dist = 1;                                                        \
+      dist <= table->max_size_shift && table->dists[current] >= dist;          \
+      dist++, current++                                                        \
+    ) {                                                                        \
+                                                                               \
+      if (                                                                     \
+        table->dists[current] == dist &&                                       \
+        eq_fn(table->entries[current].key, key)                                \
+      ) {                                                                      \
+        *position = current;                                                   \
+        return true;                                                           \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    return false;                                                              \
+  }                                                                            \
+                                                                               \
+  /* Returns false (without changing anything) if the entry would end          \
+     up (or push another entry) past the maximum probe count. */               \
+  static inline bool name##_insert(                                            \
+    struct name *table,                                                        \
+    struct name##_entry entry                                                  \
+  ) {                                                                          \
+                                                                               \
+    size_t start = rash_template_get_position(                                 \
+      hash_fn(entry.key),                                                      \
+      table->max_size_shift                                                    \
+    );                                                                         \
+                                                                               \
+    size_t end = start;                                                        \
+    uint8_t dist = 1;                                                          \
+                                                                               \
+    for (; table->dists[end]; end++, dist++) {                                 \
+                                                                               \
+      if (dist > table->dists[end]) {                                          \
+        dist = table->dists[end];                                              \
+      }                                                                        \
+                                                                               \
+      if (dist >= table->max_size_shift) {                                     \
+        return false;                                                          \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    dist = 1;                                                                  \
+                                                                               \
+    for (size_t position = start; position < end; position++, dist++) {        \
+                                                                               \
+      if (dist > table->dists[position]) {                                     \
+                                                                               \
+        struct name##_entry current = table->entries[position];                \
+        uint8_t current_dist = table->dists[position];                         \
+                                                                               \
+        table->entries[position] = entry;                                      \
+        table->dists[position] = dist;                                         \
+                                                                               \
+        entry = current;                                                       \
+        dist = current_dist;                                                   \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    table->entries[end] = entry;                                               \
+    table->dists[end] = dist;                                                  \
+    table->curr_size++;                                                        \
+                                                                               \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  /* If an entry doesn't fit when growing, the table is made bigger            \
+     still. When shrinking, the table is left as it is. */                     \
+  static inline bool name##_resize(struct name *table, int shift_amount) {     \
+                                                                               \
+    struct name old = *table;                                                  \
+                                                                               \
+    int shift = table->max_size_shift + shift_amount;                          \
+                                                                               \
+    for (;;) {                                                                 \
+                                                                               \
+      if (shift >= (int) sizeof(size_t) * 8 - 1) {                             \
+        return false;                                                          \
+      }                                                                        \
+                                                                               \
+      if (!name##_slots_alloc(table, (uint8_t) shift)) {                       \
+        *table = old;                                                          \
+        return false;                                                          \
+      }                                                                        \
+                                                                               \
+      table->curr_size = 0;                                                    \
+                                                                               \
+      size_t i = 0;                                                            \
+                                                                               \
+      for (; i < old.max_size + old.max_size_shift; i++) {                     \
+        if (old.dists[i] && !name##_insert(table, old.entries[i])) {           \
+          break;                                                               \
+        }                                                                      \
+      }                                                                        \
+                                                                               \
+      if (i == old.max_size + old.max_size_shift) {                            \
+        free(old.entries);                                                     \
+        return true;                                                           \
+      }                                                                        \
+                                                                               \
+      free(table->entries);                                                    \
+      *table = old;                                                            \
+                                                                               \
+      if (shift_amount < 0) {                                                  \
+        return false;                                                          \
+      }                                                                        \
+                                                                               \
+      shift++;                                                                 \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_init(struct name *table, size_t capacity) {        \
+                                                                               \
+    uint8_t shift = rash_template_get_shift_for_capacity(capacity);            \
+                                                                               \
+    table->curr_size = 0;                                                      \
+                                                                               \
+    return shift && name##_slots_alloc(table, shift);                          \
+  }                                                                            \
+                                                                               \
+  static inline void name##_destroy(struct name *table) {                      \
+    free(table->entries);                                                      \
+  }                                                                            \
+                                                                               \
+  static inline struct name *name##_create_with_capacity(size_t capacity) {    \
+                                                                               \
+    struct name *table = malloc(sizeof(*table));                               \
+                                                                               \
+    if (!table) {                                                              \
+      return NULL;                                                             \
+    }                                                                          \
+                                                                               \
+    if (!name##_init(table, capacity)) {                                       \
+      free(table);                                                             \
+      return NULL;                                                             \
+    }                                                                          \
+                                                                               \
+    return table;                                                              \
+  }                                                                            \
+                                                                               \
+  static inline struct name *name##_create() {                                 \
+    return name##_create_with_capacity(0);                                     \
+  }                                                                            \
+                                                                               \
+  static inline void name##_free(struct name *table) {                         \
+    name##_destroy(table);                                                     \
+    free(table);                                                               \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_add(                                               \
+    struct name *table,                                                        \
+    key_type key,                                                              \
+    value_type value                                                           \
+  ) {                                                                          \
+                                                                               \
+    size_t position;                                                           \
+                                                                               \
+    if (name##_find(table, key, &position)) {                                  \
+      table->entries[position].value = value;                                  \
+      return true;                                                             \
+    }                                                                          \
+                                                                               \
+    if (                                                                       \
+      table->curr_size + 1 >                                                   \
+      table->max_size * RASH_TEMPLATE_LOAD_FACTOR_INCREASE                     \
+    ) {                                                                        \
+      if (!name##_resize(table, 1)) {                                          \
+        return false;                                                          \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    struct name##_entry entry;                                                 \
+    entry.key = key;                                                           \
+    entry.value = value;                                                       \
+                                                                               \
+    while (!name##_insert(table, entry)) {                                     \
+      if (!name##_resize(table, 1)) {                                          \
+        return false;                                                          \
+      }                                                                        \
+    }                                                                          \
+                                                                               \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline bool name##_remove(struct name *table, key_type key) {         \
+                                                                               \
+    size_t position;                                                           \
+                                                                               \
+    if (!name##_find(table, key, &position)) {                                 \
+      return false;                                                            \
+    }                                                                          \
+                                                                               \
+    size_t end = table->max_size + table->max_size_shift;                      \
+                                                                               \
+    /* Move the following entries back a slot, until one is found which        \
+       is already in its desired position (or the slot is empty). */           \
+    for (                                                                      \
+      position++;                                                              \
+      position < end && table->dists[position] > 1;                            \
+      position++                                                               \
+    ) {                                                                        \
+      table->entries[position - 1] = table->entries[position];                 \
+      table->dists[position - 1] = table->dists[position] - 1;                 \
+    }                                                                          \
+                                                                               \
+    table->dists[position - 1] = 0;                                            \
+    table->curr_size--;                                                        \
+                                                                               \
+    /* Failing to shrink doesn't matter. */                                    \
+    if (                                                                       \
+      table->max_size_shift > RASH_TEMPLATE_INITIAL_SHIFT &&                   \
+      table->curr_size < table->max_size * RASH_TEMPLATE_LOAD_FACTOR_DECREASE  \
+    ) {                                                                        \
+      name##_resize(table, -1);                                                \
+    }                                                                          \
+                                                                               \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline value_type *name##_get(                                        \
+    const struct name *table,                                                  \
+    key_type key                                                               \
+  ) {                                                                          \
+                                                                               \
+    size_t position;                                                           \
+                                                                               \
+    if (name##_find(table, key, &position)) {                                  \
+      return &table->entries[position].value;                                  \
+    }                                                                          \
+                                                                               \
+    return NULL;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline size_t name##_get_size(const struct name *table) {             \
+    return table->curr_size;                                                   \
+  }
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2021 Kian Cross
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "rash.h"
+#include "rash_template.h"
+
+/*
+ * The keys go straight into fibonacci hashing, which spreads out keys
+ * that are close together (such as sequential IDs).
+*/
+static inline uint64_t hash_table_u64_hash(uint64_t key);
+
+/*
+ * Determine if two keys are the same.
+*/
+static inline bool hash_table_u64_equal(uint64_t a, uint64_t b);
+
+static inline uint64_t hash_table_u64_hash(uint64_t key) {
+  return key;
+}
+
+static inline bool hash_table_u64_equal(uint64_t a, uint64_t b) {
+  return a == b;
+}
+
+RASH_DEFINE_TABLE(
+  rash_u64_table,
+  uint64_t,
+  void *,
+  hash_table_u64_hash,
+  hash_table_u64_equal
+)
+
+/*
+ * A hash table with 64 bit integer keys (a generated table, with the
+ * data as the values).
+*/
+struct hash_table_u64 {
+  struct rash_u64_table table;
+};
+
+struct hash_table_u64 *hash_table_u64_create() {
+  return hash_table_u64_create_with_capacity(0);
+}
+
+struct hash_table_u64 *hash_table_u64_create_with_capacity(size_t capacity) {
+
+  struct hash_table_u64 *table = malloc(sizeof(*table));
+
+  if (!table) {
+    return NULL;
+  }
+
+  if (!rash_u64_table_init(&table->table, capacity)) {
+    free(table);
+    return NULL;
+  }
+
+  return table;
+}
+
+void hash_table_u64_free(struct hash_table_u64 *table) {
+  rash_u64_table_destroy(&table->table);
+  free(table);
+}
+
+bool hash_table_u64_add(
+  struct hash_table_u64 *table,
+  uint64_t key,
+  void *data
+) {
+  return rash_u64_table_add(&table->table, key, data);
+}
+
+bool hash_table_u64_remove(struct hash_table_u64 *table, uint64_t key) {
+  return rash_u64_table_remove(&table->table, key);
+}
+
+void *hash_table_u64_get(const struct hash_table_u64 *table, uint64_t key) {
+
+  void **data = rash_u64_table_get(&table->table, key);
+
+  return data ? *data : NULL;
+}
+
+size_t hash_table_u64_get_size(const struct hash_table_u64 *table) {
+  return rash_u64_table_get_size(&table->table);
+}
@@ -5,9 +5,15 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
 #include <assert.h>
 
 #include "../src/rash.h"
+#include "../src/rash_hash.h"
+#include "../src/rash_template.h"
 
 /*
  * Ensure creating a hash table works.
@@ -213,8 +219,1454 @@ static void hash_table_tests_remove_many() {
   hash_table_free(table);
 }
 
+/*
+ * Case insensitive hash function used for testing custom functions.
+*/
+static size_t hash_table_tests_case_insensitive_hash(
+  const char *key,
+  size_t length,
+  void *context
+) {
+
+  size_t hash = 5381;
+
+  for (size_t i = 0; i < length; i++) {
+    hash = ((hash << 5) + hash) + tolower((unsigned char) key[i]);
+  }
+
+  (*(int *) context)++;
+
+  return hash;
+}
+
+/*
+ * Case insensitive equality function used for testing custom functions.
+*/
+static bool hash_table_tests_case_insensitive_equal(
+  const char *key1,
+  size_t length1,
+  const char *key2,
+  size_t length2,
+  void *context
+) {
+
+  (void) context;
+
+  if (length1 != length2) {
+    return false;
+  }
+
+  for (size_t i = 0; i < length1; i++) {
+    if (tolower((unsigned char) key1[i]) != tolower((unsigned char) key2[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Ensure a table uses the hash and equality functions it is created
+ * with.
+*/
+static void hash_table_tests_custom_functions() {
+
+  int hash_calls = 0;
+
+  struct hash_table_options options = {0};
+  options.hash = hash_table_tests_case_insensitive_hash;
+  options.equal = hash_table_tests_case_insensitive_equal;
+  options.context = &hash_calls;
+
+  struct hash_table *table = hash_table_create_ex(&options);
+  assert(table);
+
+  int a = 20;
+  int b = 30;
+
+  assert(hash_table_add(table, "Key1", &a));
+  assert(hash_table_get(table, "KEY1") == &a);
+  assert(hash_table_get(table, "key1") == &a);
+
+  assert(hash_table_add(table, "kEy1", &b));
+  assert(hash_table_get_size(table) == 1);
+  assert(hash_table_get(table, "key1") == &b);
+
+  assert(!hash_table_get(table, "key2"));
+
+  assert(hash_table_remove(table, "KEY1"));
+  assert(hash_table_get_size(table) == 0);
+  assert(!hash_table_get(table, "key1"));
+  assert(!hash_table_remove(table, "Key1"));
+
+  // How many times the hash is needed is up to the table.
+  assert(hash_calls > 0);
+
+  hash_table_free(table);
+}
+
+/*
+ * Ensure a table created with a capacity works, and that an
+ * impossible capacity is rejected.
+*/
+static void hash_table_tests_create_with_capacity() {
+
+  struct hash_table *table = hash_table_create_with_capacity(1000);
+  assert(table);
+
+  int numbers[1000];
+
+  for (size_t i = 0; i < 1000; i++) {
+
+    char key[16];
+    snprintf(key, sizeof(key), "key_%zu", i);
+
+    assert(hash_table_add(table, key, numbers + i));
+  }
+
+  for (size_t i = 0; i < 1000; i++) {
+
+    char key[16];
+    snprintf(key, sizeof(key), "key_%zu", i);
+
+    assert(hash_table_get(table, key) == numbers + i);
+  }
+
+  assert(hash_table_get_size(table) == 1000);
+
+  hash_table_free(table);
+
+  assert(!hash_table_create_with_capacity((size_t) -1));
+}
+
+/*
+ * Ensure reserving space keeps the existing elements.
+*/
+static void hash_table_tests_reserve() {
+
+  struct hash_table *table = hash_table_create();
+  assert(table);
+
+  int a = 20;
+  int b = 30;
+
+  assert(hash_table_add(table, "key1", &a));
+  assert(hash_table_add(table, "key2", &b));
+
+  assert(hash_table_reserve(table, 10000));
+  assert(hash_table_get_size(table) == 2);
+  assert(hash_table_get(table, "key1") == &a);
+  assert(hash_table_get(table, "key2") == &b);
+
+  // Reserving less space than the table already has does nothing.
+  assert(hash_table_reserve(table, 1));
+  assert(hash_table_get(table, "key1") == &a);
+
+  assert(!hash_table_reserve(table, (size_t) -1));
+  assert(hash_table_get(table, "key2") == &b);
+
+  // A number of buckets that fits in a size_t, but whose memory does
+  // not.
+  size_t capacity = (size_t) 1 << (sizeof(size_t) * 8 - 4);
+
+  assert(!hash_table_reserve(table, capacity));
+  assert(!hash_table_create_with_capacity(capacity));
+  assert(hash_table_get_size(table) == 2);
+  assert(hash_table_get(table, "key2") == &b);
+
+  hash_table_free(table);
+}
+
+/*
+ * Hash function which gives every group of four keys ("key_0" to
+ * "key_3", "key_4" to "key_7", ...) the same hash.
+*/
+static size_t hash_table_tests_grouped_hash(
+  const char *key,
+  size_t length,
+  void *context
+) {
+
+  (void) length;
+  (void) context;
+
+  size_t number = strtoul(key + 4, NULL, 10);
+  return (number / 4 + 1) * (size_t) 0x9e3779b97f4a7c15llu;
+}
+
+/*
+ * Ensure elements are kept as the table grows (one step at a time,
+ * and all at once) when many of them want the same position.
+*/
+static void hash_table_tests_resize_grouped() {
+
+  struct hash_table_options options = {0};
+  options.hash = hash_table_tests_grouped_hash;
+
+  struct hash_table *table = hash_table_create_ex(&options);
+  assert(table);
+
+  int numbers[2000];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t i = 0; i < N; i++) {
+
+    char key[16];
+    snprintf(key, sizeof(key), "key_%zu", i);
+
+    assert(hash_table_add(table, key, numbers + i));
+  }
+
+  assert(hash_table_reserve(table, N * 64));
+  assert(hash_table_get_size(table) == N);
+
+  for (size_t i = 0; i < N; i++) {
+
+    char key[16];
+    snprintf(key, sizeof(key), "key_%zu", i);
+
+    assert(hash_table_get(table, key) == numbers + i);
+  }
+
+  hash_table_free(table);
+}
+
+/*
+ * Ensure a table which grows incrementally keeps its elements while
+ * they are being moved, including ones which are replaced or removed
+ * before they are moved.
+*/
+static void hash_table_tests_incremental() {
+
+  struct hash_table_options options = {0};
+  options.incremental = true;
+
+  struct hash_table *table = hash_table_create_ex(&options);
+  assert(table);
+
+  int numbers[5000];
+  int replacements[5000];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t i = 0; i < N; i++) {
+
+    char key[16];
+    snprintf(key, sizeof(key), "key_%zu", i);
+
+    assert(hash_table_add(table, key, numbers + i));
+    assert(hash_table_get_size(table) == i + 1);
+
+    // Replace an earlier element, which may not have been moved yet.
+    snprintf(key, sizeof(key), "key_%zu", i / 2);
+    assert(hash_table_add(table, key, replacements + i / 2));
+    assert(hash_table_get_size(table) == i + 1);
+
+    for (size_t j = 0; j <= i; j++) {
+
+      snprintf(key, sizeof(key), "key_%zu", j);
+
+      int *expected = j <= i / 2 ? replacements + j : numbers + j;
+      assert(hash_table_get(table, key) == expected);
+    }
+  }
+
+  for (size_t i = 0; i < N; i++) {
+
+    char key[16];
+    snprintf(key, sizeof(key), "key_%zu", i);
+
+    assert(hash_table_remove(table, key));
+    assert(!hash_table_get(table, key));
+    assert(hash_table_get_size(table) == N - i - 1);
+  }
+
+  hash_table_free(table);
+}
+
+/*
+ * Ensure reserving space in a table which grows incrementally moves
+ * the elements which have not been moved yet without hashing any of
+ * them again, whatever point the table has got to.
+*/
+static void hash_table_tests_reserve_incremental() {
+
+  int numbers[300];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t n = 1; n <= N; n++) {
+
+    int hash_calls = 0;
+
+    struct hash_table_options options = {0};
+    options.hash = hash_table_tests_case_insensitive_hash;
+    options.equal = hash_table_tests_case_insensitive_equal;
+    options.context = &hash_calls;
+    options.incremental = true;
+
+    struct hash_table *table = hash_table_create_ex(&options);
+    assert(table);
+
+    for (size_t i = 0; i < n; i++) {
+
+      char key[16];
+      snprintf(key, sizeof(key), "key_%zu", i);
+
+      assert(hash_table_add(table, key, numbers + i));
+    }
+
+    int calls_before_reserve = hash_calls;
+
+    assert(hash_table_reserve(table, N * 64));
+    assert(hash_calls == calls_before_reserve);
+    assert(hash_table_get_size(table) == n);
+
+    for (size_t i = 0; i < n; i++) {
+
+      char key[16];
+      snprintf(key, sizeof(key), "KEY_%zu", i);
+
+      assert(hash_table_get(table, key) == numbers + i);
+    }
+
+    hash_table_free(table);
+  }
+}
+
+/*
+ * Ensure keys of many different lengths (which are stored in
+ * different ways) can be added, replaced and removed.
+*/
+static void hash_table_tests_key_lengths() {
+
+  struct hash_table *table = hash_table_create();
+  assert(table);
+
+  char key[600];
+  int numbers[sizeof(key)];
+
+  for (size_t length = 0; length < sizeof(key); length++) {
+
+    memset(key, 'a', length);
+    key[length] = '\0';
+
+    assert(hash_table_add(table, key, numbers + length));
+  }
+
+  assert(hash_table_get_size(table) == sizeof(key));
+
+  for (size_t length = 0; length < sizeof(key); length++) {
+
+    memset(key, 'a', length);
+    key[length] = '\0';
+
+    assert(hash_table_get(table, key) == numbers + length);
+
+    if (length % 2) {
+      assert(hash_table_remove(table, key));
+    } else {
+      assert(hash_table_add(table, key, numbers));
+    }
+  }
+
+  assert(hash_table_get_size(table) == sizeof(key) / 2);
+
+  hash_table_free(table);
+}
+
+/*
+ * Ensure keys can be replaced and removed many times over (which
+ * leaves a lot of unused space behind where keys were stored).
+*/
+static void hash_table_tests_churn() {
+
+  struct hash_table *table = hash_table_create();
+  assert(table);
+
+  int numbers[1000];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t round = 0; round < 100; round++) {
+    for (size_t i = 0; i < N; i++) {
+
+      char key[64];
+      snprintf(key, sizeof(key), "a_longer_key_to_use_up_space_%zu", i);
+
+      if (round % 3 == 2) {
+        assert(hash_table_remove(table, key));
+      } else {
+        assert(hash_table_add(table, key, numbers + (i + round) % N));
+      }
+    }
+
+    for (size_t i = 0; i < N; i++) {
+
+      char key[64];
+      snprintf(key, sizeof(key), "a_longer_key_to_use_up_space_%zu", i);
+
+      int *expected = round % 3 == 2 ? NULL : numbers + (i + round) % N;
+      assert(hash_table_get(table, key) == expected);
+    }
+  }
+
+  hash_table_free(table);
+}
+
+/*
+ * Ensure tables sharing an interner work, and that keys are only
+ * stored once.
+*/
+static void hash_table_tests_interner() {
+
+  struct hash_table_interner *interner = hash_table_interner_create();
+  assert(interner);
+
+  struct hash_table_options options = {0};
+  options.interner = interner;
+
+  struct hash_table *table1 = hash_table_create_ex(&options);
+  struct hash_table *table2 = hash_table_create_ex(&options);
+  assert(table1 && table2);
+
+  int a = 20;
+  int b = 30;
+
+  assert(hash_table_add(table1, "a_key_long_enough_to_be_shared_1", &a));
+  assert(hash_table_add(table2, "a_key_long_enough_to_be_shared_1", &b));
+  assert(hash_table_add(table2, "a_key_long_enough_to_be_shared_2", &b));
+  assert(hash_table_interner_get_size(interner) == 2);
+
+  assert(hash_table_get(table1, "a_key_long_enough_to_be_shared_1") == &a);
+  assert(hash_table_get(table2, "a_key_long_enough_to_be_shared_1") == &b);
+  assert(!hash_table_get(table1, "a_key_long_enough_to_be_shared_2"));
+
+  // Short keys are stored in the table itself.
+  assert(hash_table_add(table1, "short", &a));
+  assert(hash_table_interner_get_size(interner) == 2);
+
+  // Replacing an element keeps the key.
+  assert(hash_table_add(table1, "a_key_long_enough_to_be_shared_1", &b));
+  assert(hash_table_interner_get_size(interner) == 2);
+
+  assert(hash_table_remove(table2, "a_key_long_enough_to_be_shared_1"));
+  assert(hash_table_get(table1, "a_key_long_enough_to_be_shared_1") == &b);
+  assert(hash_table_interner_get_size(interner) == 2);
+
+  assert(hash_table_remove(table1, "a_key_long_enough_to_be_shared_1"));
+  assert(hash_table_interner_get_size(interner) == 1);
+
+  hash_table_free(table2);
+  assert(hash_table_interner_get_size(interner) == 0);
+
+  hash_table_free(table1);
+  hash_table_interner_free(interner);
+}
+
+/*
+ * State of the allocator used for testing.
+*/
+struct hash_table_tests_allocator_state {
+  size_t allocated;
+  bool fail;
+};
+
+/*
+ * Header stored in front of memory given by the testing allocator
+ * (aligned for any type).
+*/
+union hash_table_tests_allocator_header {
+  size_t size;
+  long double alignment1;
+  long long alignment2;
+  void *alignment3;
+};
+
+/*
+ * Allocator which keeps track of how much memory is in use, and checks
+ * that memory is freed with the size it was allocated with.
+*/
+static void *hash_table_tests_alloc(size_t size, void *context) {
+
+  struct hash_table_tests_allocator_state *state = context;
+
+  if (state->fail) {
+    return NULL;
+  }
+
+  // Store the size in front of the memory.
+  union hash_table_tests_allocator_header *header =
+    malloc(sizeof(*header) + size);
+  assert(header);
+
+  header->size = size;
+  state->allocated += size;
+
+  return header + 1;
+}
+
+static void hash_table_tests_free(void *memory, size_t size, void *context) {
+
+  struct hash_table_tests_allocator_state *state = context;
+
+  union hash_table_tests_allocator_header *header =
+    (union hash_table_tests_allocator_header *) memory - 1;
+  assert(header->size == size);
+
+  state->allocated -= size;
+  free(header);
+}
+
+/*
+ * Compare two hashes (for qsort).
+*/
+static int hash_table_tests_compare_hashes(const void *a, const void *b) {
+
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * Ensure the built in hash functions give every short key (of up to 8
+ * bytes, and a bit longer) a different hash. With a quarter of a
+ * million keys, a hash with only 2^32 different values for them would
+ * have a few collisions.
+*/
+static void hash_table_tests_hash_distinct() {
+
+  rash_hash_function functions[2] = {rash_hash_wy, rash_hash_crc32c};
+  size_t function_count = rash_hash_crc32c_supported() ? 2 : 1;
+
+  static uint64_t hashes[1 << 18];
+
+  const size_t N = sizeof(hashes) / sizeof(hashes[0]);
+
+  for (size_t f = 0; f < function_count; f++) {
+    for (size_t length = 1; length <= 12; length++) {
+
+      for (size_t i = 0; i < N; i++) {
+
+        // The number in the key is spread over all of its bytes.
+        uint8_t key[12];
+        uint64_t number = i * 0x9e3779b97f4a7c15llu;
+
+        for (size_t j = 0; j < length; j++) {
+          key[j] = (uint8_t) (number >> (8 * (j % 8)));
+        }
+
+        hashes[i] = functions[f](key, length, 42);
+      }
+
+      qsort(hashes, N, sizeof(hashes[0]), hash_table_tests_compare_hashes);
+
+      // Keys of under 3 bytes can't all be different.
+      for (size_t i = 1; i < N && length >= 3; i++) {
+        assert(hashes[i] != hashes[i - 1]);
+      }
+    }
+  }
+}
+
+/*
+ * Ensure a table only uses the allocator it is given.
+*/
+static void hash_table_tests_allocator() {
+
+  struct hash_table_tests_allocator_state state = {0};
+
+  struct hash_table_allocator allocator;
+  allocator.alloc = hash_table_tests_alloc;
+  allocator.free = hash_table_tests_free;
+  allocator.context = &state;
+
+  struct hash_table_options options = {0};
+  options.allocator = &allocator;
+  options.incremental = true;
+
+  struct hash_table *table = hash_table_create_ex(&options);
+  assert(table);
+  assert(state.allocated > 0);
+
+  int numbers[2000];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t i = 0; i < N; i++) {
+
+    char key[64];
+    snprintf(key, sizeof(key), "a_key_which_is_too_long_to_be_inline_%zu", i);
+
+    assert(hash_table_add(table, key, numbers + i));
+
+    if (i % 2) {
+      snprintf(key, sizeof(key), "k%zu", i);
+      assert(hash_table_add(table, key, numbers + i));
+    }
+  }
+
+  // A key this big always needs more memory, which fails to be
+  // allocated.
+  static char big_key[100000];
+  memset(big_key, 'a', sizeof(big_key) - 1);
+
+  state.fail = true;
+  assert(!hash_table_add(table, big_key, numbers));
+  state.fail = false;
+
+  assert(!hash_table_get(table, big_key));
+  assert(hash_table_add(table, big_key, numbers));
+  assert(hash_table_remove(table, big_key));
+
+  for (size_t i = 0; i < N; i++) {
+
+    char key[64];
+    snprintf(key, sizeof(key), "a_key_which_is_too_long_to_be_inline_%zu", i);
+
+    assert(hash_table_get(table, key) == numbers + i);
+    assert(hash_table_remove(table, key));
+  }
+
+  hash_table_free(table);
+  assert(state.allocated == 0);
+
+  state.fail = true;
+  assert(!hash_table_create_ex(&options));
+}
+
+/*
+ * Ensure an interner only uses the allocator it is given.
+*/
+static void hash_table_tests_interner_allocator() {
+
+  struct hash_table_tests_allocator_state state = {0};
+
+  struct hash_table_allocator allocator;
+  allocator.alloc = hash_table_tests_alloc;
+  allocator.free = hash_table_tests_free;
+  allocator.context = &state;
+
+  struct hash_table_interner *interner =
+    hash_table_interner_create_ex(&allocator);
+  assert(interner);
+  assert(state.allocated > 0);
+
+  struct hash_table_options options = {0};
+  options.interner = interner;
+
+  struct hash_table *table = hash_table_create_ex(&options);
+  assert(table);
+
+  int numbers[500];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t i = 0; i < N; i++) {
+
+    char key[64];
+    snprintf(key, sizeof(key), "a_key_long_enough_to_be_shared_%zu", i);
+
+    assert(hash_table_add(table, key, numbers + i));
+  }
+
+  assert(hash_table_interner_get_size(interner) == N);
+
+  // Interning a key which fails to be allocated leaves the table and
+  // the interner as they were.
+  static char big_key[100000];
+  memset(big_key, 'a', sizeof(big_key) - 1);
+
+  state.fail = true;
+  assert(!hash_table_add(table, big_key, numbers));
+  state.fail = false;
+
+  assert(!hash_table_get(table, big_key));
+  assert(hash_table_interner_get_size(interner) == N);
+
+  for (size_t i = 0; i < N; i += 2) {
+
+    char key[64];
+    snprintf(key, sizeof(key), "a_key_long_enough_to_be_shared_%zu", i);
+
+    assert(hash_table_get(table, key) == numbers + i);
+    assert(hash_table_remove(table, key));
+  }
+
+  hash_table_free(table);
+  assert(hash_table_interner_get_size(interner) == 0);
+
+  hash_table_interner_free(interner);
+  assert(state.allocated == 0);
+
+  state.fail = true;
+  assert(!hash_table_interner_create_ex(&allocator));
+}
+
+/*
+ * Ensure keys under 24 bytes (and a bit longer) are stored without
+ * allocating anything for them.
+*/
+static void hash_table_tests_inline_keys() {
+
+  struct hash_table_tests_allocator_state state = {0};
+
+  struct hash_table_allocator allocator;
+  allocator.alloc = hash_table_tests_alloc;
+  allocator.free = hash_table_tests_free;
+  allocator.context = &state;
+
+  struct hash_table_options options = {0};
+  options.allocator = &allocator;
+  options.capacity = 1000;
+
+  struct hash_table *table = hash_table_create_ex(&options);
+  assert(table);
+
+  size_t allocated = state.allocated;
+
+  static int numbers[500];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t i = 0; i < N; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), i % 2 ? "%023zu" : "%027zu", i);
+    assert(hash_table_add(table, key, numbers + i));
+  }
+
+  assert(state.allocated == allocated);
+
+  for (size_t i = 0; i < N; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), i % 2 ? "%023zu" : "%027zu", i);
+    assert(hash_table_get(table, key) == numbers + i);
+  }
+
+  // A longer key has to be copied somewhere else.
+  assert(hash_table_add(table, "a_key_which_is_too_long_to_be_inline", NULL));
+  assert(state.allocated > allocated);
+
+  hash_table_free(table);
+  assert(state.allocated == 0);
+}
+
+/*
+ * Ensure tables work when their buckets are mapped with huge pages
+ * (through growing, shrinking and freeing).
+*/
+static void hash_table_tests_huge_pages() {
+
+  for (int incremental = 0; incremental < 2; incremental++) {
+
+    struct hash_table_options options = {0};
+    options.incremental = incremental;
+
+    // Map every bucket array, however small.
+    options.huge_page_threshold = 1;
+
+    struct hash_table *table = hash_table_create_ex(&options);
+    assert(table);
+
+    static int numbers[100000];
+
+    const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+    for (size_t i = 0; i < N; i++) {
+      char key[32];
+      snprintf(key, sizeof(key), "%zu", i);
+      assert(hash_table_add(table, key, numbers + i));
+    }
+
+    for (size_t i = 0; i < N; i++) {
+      char key[32];
+      snprintf(key, sizeof(key), "%zu", i);
+      assert(hash_table_get(table, key) == numbers + i);
+      assert(hash_table_remove(table, key));
+    }
+
+    assert(hash_table_get_size(table) == 0);
+    hash_table_free(table);
+  }
+}
+
+/*
+ * Ensure a batch of lookups gives the same results as looking up each
+ * key on its own (including while the table is growing
+ * incrementally).
+*/
+static void hash_table_tests_get_batch() {
+
+  struct hash_table_options options = {0};
+  options.incremental = true;
+
+  struct hash_table *table = hash_table_create_ex(&options);
+  assert(table);
+
+  static int numbers[1000];
+  static char keys[2 * 1000][32];
+  const char *key_pointers[2 * 1000];
+  void *data[2 * 1000];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t i = 0; i < 2 * N; i++) {
+    snprintf(keys[i], sizeof(keys[i]), "%s%zu", i % 2 ? "miss" : "hit", i);
+    key_pointers[i] = keys[i];
+  }
+
+  for (size_t i = 0; i < N; i++) {
+    assert(hash_table_add(table, keys[2 * i], numbers + i));
+
+    // Batches of every size, most of which aren't a whole number of
+    // the internal batch size.
+    hash_table_get_batch(table, key_pointers, 2 * i + 2, data);
+
+    for (size_t j = 0; j < 2 * i + 2; j++) {
+      assert(data[j] == (j % 2 ? NULL : numbers + j / 2));
+      assert(data[j] == hash_table_get(table, keys[j]));
+    }
+  }
+
+  hash_table_get_batch(table, key_pointers, 0, data);
+
+  hash_table_free(table);
+}
+
+/*
+ * Ensure adding a batch of pairs (including ones with the same key) is
+ * the same as adding them one at a time.
+*/
+static void hash_table_tests_add_batch() {
+
+  for (int incremental = 0; incremental < 2; incremental++) {
+
+    struct hash_table_options options = {0};
+    options.incremental = incremental;
+
+    struct hash_table *table = hash_table_create_ex(&options);
+    assert(table);
+
+    const char *long_key = "a_key_which_is_too_long_to_be_inline_0";
+    assert(hash_table_add(table, long_key, NULL));
+
+    static int numbers[5000];
+    static char keys[5000][64];
+    static struct hash_table_pair pairs[5000];
+
+    const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+    for (size_t i = 0; i < N; i++) {
+
+      // Every key is used twice, and half of them are long.
+      size_t key = i % (N / 2);
+
+      snprintf(
+        keys[i],
+        sizeof(keys[i]),
+        key % 2 ? "k%zu" : "a_key_which_is_too_long_to_be_inline_%zu",
+        key
+      );
+
+      pairs[i].key = keys[i];
+      pairs[i].data = numbers + i;
+    }
+
+    assert(hash_table_add_batch(table, pairs, 0));
+    assert(hash_table_add_batch(table, pairs, N));
+    assert(hash_table_get_size(table) == N / 2);
+
+    for (size_t i = 0; i < N / 2; i++) {
+      assert(hash_table_get(table, keys[i]) == numbers + i + N / 2);
+    }
+
+    hash_table_free(table);
+  }
+}
+
+/*
+ * Ensure a table built by several threads holds every pair (whether or
+ * not threads are actually used).
+*/
+static void hash_table_tests_add_parallel() {
+
+  static int numbers[300000];
+  static char keys[300000][48];
+  static struct hash_table_pair pairs[300000];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t i = 0; i < N; i++) {
+    snprintf(
+      keys[i],
+      sizeof(keys[i]),
+      i % 3 ? "%zu" : "a_key_which_is_too_long_to_be_inline_%zu",
+      i
+    );
+
+    pairs[i].key = keys[i];
+    pairs[i].data = numbers + i;
+  }
+
+  for (unsigned int threads = 8; threads >= 1; threads /= 2) {
+
+    struct hash_table *table = hash_table_create();
+    assert(table);
+
+    assert(hash_table_add_parallel(table, pairs, N, threads));
+    assert(hash_table_get_size(table) == N);
+
+    for (size_t i = 0; i < N; i++) {
+      assert(hash_table_get(table, keys[i]) == numbers + i);
+    }
+
+    // Adding the same keys again replaces them.
+    assert(hash_table_add_parallel(table, pairs, N / 2, threads));
+    assert(hash_table_get_size(table) == N);
+
+    for (size_t i = 0; i < N; i++) {
+      assert(hash_table_remove(table, keys[i]));
+    }
+
+    assert(hash_table_get_size(table) == 0);
+    hash_table_free(table);
+  }
+
+  // A key given twice is only stored once.
+  struct hash_table *table = hash_table_create();
+  assert(table);
+
+  pairs[N - 1].key = keys[0];
+  assert(hash_table_add_parallel(table, pairs, N, 4));
+  assert(hash_table_get_size(table) == N - 1);
+
+  void *data = hash_table_get(table, keys[0]);
+  assert(data == numbers || data == numbers + N - 1);
+
+  hash_table_free(table);
+}
+
+/*
+ * Ensure get_or_insert can be used to count the number of times each
+ * key is seen.
+*/
+static void hash_table_tests_get_or_insert() {
+
+  for (int incremental = 0; incremental < 2; incremental++) {
+
+    struct hash_table_options options = {0};
+    options.incremental = incremental;
+
+    struct hash_table *table = hash_table_create_ex(&options);
+    assert(table);
+
+    const size_t N = 5000;
+
+    for (size_t round = 0; round < 3; round++) {
+      for (size_t i = 0; i < N; i++) {
+
+        char key[64];
+        snprintf(
+          key,
+          sizeof(key),
+          i % 2 ? "%zu" : "a_key_which_is_too_long_to_be_inline_%zu",
+          i
+        );
+
+        // Key i is seen i % 5 + 1 times a round.
+        for (size_t j = 0; j <= i % 5; j++) {
+
+          bool inserted;
+          void **data = hash_table_get_or_insert(table, key, &inserted);
+          assert(data);
+          assert(inserted == (round == 0 && j == 0));
+          assert(!inserted || !*data);
+
+          *data = (void *) ((uintptr_t) *data + 1);
+        }
+      }
+    }
+
+    assert(hash_table_get_size(table) == N);
+
+    for (size_t i = 0; i < N; i++) {
+
+      char key[64];
+      snprintf(
+        key,
+        sizeof(key),
+        i % 2 ? "%zu" : "a_key_which_is_too_long_to_be_inline_%zu",
+        i
+      );
+
+      uintptr_t count = (uintptr_t) hash_table_get(table, key);
+      assert(count == 3 * (i % 5 + 1));
+    }
+
+    assert(hash_table_get_or_insert(table, "k", NULL));
+    assert(hash_table_get_size(table) == N + 1);
+
+    hash_table_free(table);
+  }
+}
+
+/*
+ * Ensure replacing the data of a key gives back the data it replaces.
+*/
+static void hash_table_tests_replace() {
+
+  struct hash_table *table = hash_table_create();
+  assert(table);
+
+  int a = 20;
+  int b = 30;
+  void *previous = &a;
+
+  const char *key = "a_key_which_is_too_long_to_be_inline";
+
+  assert(hash_table_replace(table, key, &a, &previous));
+  assert(previous == NULL);
+
+  assert(hash_table_replace(table, key, &b, &previous));
+  assert(previous == &a);
+  assert(hash_table_get(table, key) == &b);
+
+  assert(hash_table_replace(table, key, NULL, NULL));
+  assert(hash_table_get(table, key) == NULL);
+  assert(hash_table_get_size(table) == 1);
+
+  assert(hash_table_add(table, "short", &a));
+  assert(hash_table_replace(table, "short", &b, &previous));
+  assert(previous == &a);
+  assert(hash_table_get_size(table) == 2);
+
+  hash_table_free(table);
+}
+
+/*
+ * Ensure keys can be borrowed or handed over to a table (as well as
+ * copied), including while the table grows and compacts its keys.
+*/
+static void hash_table_tests_key_owners() {
+
+  struct hash_table_tests_allocator_state state = {0};
+
+  struct hash_table_allocator allocator;
+  allocator.alloc = hash_table_tests_alloc;
+  allocator.free = hash_table_tests_free;
+  allocator.context = &state;
+
+  struct hash_table_options options = {0};
+  options.allocator = &allocator;
+
+  struct hash_table *table = hash_table_create_ex(&options);
+  assert(table);
+
+  static int numbers[3000];
+  static char borrowed[3000][64];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t round = 0; round < 3; round++) {
+    for (size_t i = 0; i < N; i++) {
+
+      snprintf(
+        borrowed[i],
+        sizeof(borrowed[i]),
+        i % 2 ? "%zu" : "a_key_which_is_too_long_to_be_inline_%zu",
+        i
+      );
+
+      // Each key is owned in a different way each round.
+      switch ((i + round) % 3) {
+
+        case 0:
+          assert(hash_table_add(table, borrowed[i], numbers + i));
+          break;
+
+        case 1:
+          assert(hash_table_add_borrowed(table, borrowed[i], numbers + i));
+          break;
+
+        case 2: {
+          size_t size = strlen(borrowed[i]) + 1;
+          char *owned = hash_table_tests_alloc(size, &state);
+          memcpy(owned, borrowed[i], size);
+          assert(hash_table_add_owned(table, owned, numbers + i));
+          break;
+        }
+      }
+    }
+
+    assert(hash_table_get_size(table) == N);
+
+    for (size_t i = 0; i < N; i++) {
+      assert(hash_table_get(table, borrowed[i]) == numbers + i);
+
+      if (i % 4 == round) {
+        assert(hash_table_remove(table, borrowed[i]));
+      }
+    }
+  }
+
+  // Removing and freeing the table frees every owned key.
+  for (size_t i = 0; i < N / 2; i++) {
+    hash_table_remove(table, borrowed[i]);
+  }
+
+  hash_table_free(table);
+  assert(state.allocated == 0);
+}
+
+/*
+ * Ensure keys can be given with a length, without a terminator, and
+ * with zero bytes inside them.
+*/
+static void hash_table_tests_length_keys() {
+
+  struct hash_table_options options = {0};
+  options.incremental = true;
+
+  struct hash_table *table = hash_table_create_ex(&options);
+  assert(table);
+
+  int a = 20;
+  int b = 30;
+
+  // Keys which differ only after a zero byte.
+  assert(hash_table_add_n(table, "ab\0c", 4, &a));
+  assert(hash_table_add_n(table, "ab\0d", 4, &b));
+  assert(hash_table_add_n(table, "ab", 3, &b));
+  assert(hash_table_get_size(table) == 3);
+
+  assert(hash_table_get_n(table, "ab\0c", 4) == &a);
+  assert(hash_table_get_n(table, "ab\0d", 4) == &b);
+  assert(hash_table_get(table, "ab") == NULL);
+
+  assert(hash_table_remove_n(table, "ab\0c", 4));
+  assert(!hash_table_get_n(table, "ab\0c", 4));
+  assert(hash_table_get_n(table, "ab\0d", 4) == &b);
+
+  // Slices of a buffer, which have nothing after them (so reading
+  // past the end of a key would be caught by a memory checker).
+  static int numbers[2000];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (size_t round = 0; round < 2; round++) {
+    for (size_t i = 0; i < N; i++) {
+
+      char buffer[64];
+      int length = snprintf(
+        buffer,
+        sizeof(buffer),
+        "a_key_which_may_be_too_long_to_be_inline_%zu",
+        i
+      );
+
+      // Keys of every length up to the whole buffer.
+      size_t key_length = i % (size_t) length + 1;
+
+      char *key = malloc(key_length);
+      assert(key);
+      memcpy(key, buffer, key_length);
+
+      int *number = numbers + key_length;
+
+      if (round == 0) {
+        assert(hash_table_add_n(table, key, key_length, number));
+      } else {
+        assert(hash_table_get_n(table, key, key_length) == number);
+      }
+
+      free(key);
+    }
+  }
+
+  hash_table_free(table);
+}
+
+/*
+ * Ensure the tables with 64 bit integer keys work, for keys that are
+ * close together and ones that are spread out, while growing and
+ * shrinking.
+*/
+static void hash_table_tests_u64() {
+
+  struct hash_table_u64 *table = hash_table_u64_create();
+  assert(table);
+
+  int a = 20;
+  int b = 30;
+
+  assert(!hash_table_u64_get(table, 0));
+  assert(!hash_table_u64_remove(table, 0));
+
+  assert(hash_table_u64_add(table, 0, &a));
+  assert(hash_table_u64_add(table, UINT64_MAX, &b));
+  assert(hash_table_u64_get(table, 0) == &a);
+  assert(hash_table_u64_get(table, UINT64_MAX) == &b);
+
+  // Adding an existing key replaces its data.
+  assert(hash_table_u64_add(table, 0, &b));
+  assert(hash_table_u64_get(table, 0) == &b);
+  assert(hash_table_u64_get_size(table) == 2);
+
+  assert(hash_table_u64_remove(table, 0));
+  assert(hash_table_u64_remove(table, UINT64_MAX));
+  assert(hash_table_u64_get_size(table) == 0);
+
+  static int numbers[20000];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  // Sequential keys, and keys which only differ in their high bits.
+  const uint64_t steps[] = {1, (uint64_t) 1 << 40};
+
+  for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+
+    uint64_t step = steps[s];
+
+    for (size_t i = 0; i < N; i++) {
+      assert(hash_table_u64_add(table, i * step, numbers + i));
+    }
+
+    assert(hash_table_u64_get_size(table) == N);
+
+    for (size_t i = 0; i < N; i++) {
+      assert(hash_table_u64_get(table, i * step) == numbers + i);
+    }
+
+    // Remove every other key, then the rest.
+    for (size_t start = 0; start < 2; start++) {
+      for (size_t i = start; i < N; i += 2) {
+        assert(hash_table_u64_remove(table, i * step));
+        assert(!hash_table_u64_get(table, i * step));
+      }
+
+      for (size_t i = 1; i < N && start == 0; i += 2) {
+        assert(hash_table_u64_get(table, i * step) == numbers + i);
+      }
+    }
+
+    assert(hash_table_u64_get_size(table) == 0);
+  }
+
+  hash_table_u64_free(table);
+
+  table = hash_table_u64_create_with_capacity(N);
+  assert(table);
+
+  // Random keys (from a fixed sequence).
+  uint64_t key = 88172645463325252llu;
+
+  for (size_t i = 0; i < N; i++) {
+    key ^= key << 13;
+    key ^= key >> 7;
+    key ^= key << 17;
+    assert(hash_table_u64_add(table, key, numbers + i));
+  }
+
+  assert(hash_table_u64_get_size(table) == N);
+
+  key = 88172645463325252llu;
+
+  for (size_t i = 0; i < N; i++) {
+    key ^= key << 13;
+    key ^= key >> 7;
+    key ^= key << 17;
+    assert(hash_table_u64_get(table, key) == numbers + i);
+  }
+
+  hash_table_u64_free(table);
+}
+
+/*
+ * A point, used as the key of a generated table.
+*/
+struct hash_table_tests_point {
+  int32_t x;
+  int32_t y;
+};
+
+/*
+ * A value stored inline in a generated table.
+*/
+struct hash_table_tests_counter {
+  size_t count;
+  double total;
+};
+
+static inline uint64_t hash_table_tests_point_hash(
+  struct hash_table_tests_point point
+) {
+  return ((uint64_t) (uint32_t) point.x << 32) | (uint32_t) point.y;
+}
+
+static inline bool hash_table_tests_point_equal(
+  struct hash_table_tests_point a,
+  struct hash_table_tests_point b
+) {
+  return a.x == b.x && a.y == b.y;
+}
+
+RASH_DEFINE_TABLE(
+  hash_table_tests_points,
+  struct hash_table_tests_point,
+  struct hash_table_tests_counter,
+  hash_table_tests_point_hash,
+  hash_table_tests_point_equal
+)
+
+/*
+ * Ensure generated tables work with struct keys and values, including
+ * updating values in place, and when embedded in something else.
+*/
+static void hash_table_tests_template() {
+
+  struct hash_table_tests_points *table = hash_table_tests_points_create();
+  assert(table);
+
+  struct hash_table_tests_point origin = {0, 0};
+  struct hash_table_tests_counter counter = {1, 0.5};
+
+  assert(!hash_table_tests_points_get(table, origin));
+  assert(!hash_table_tests_points_remove(table, origin));
+
+  assert(hash_table_tests_points_add(table, origin, counter));
+  assert(hash_table_tests_points_get_size(table) == 1);
+
+  // Values can be updated through the pointer that is returned.
+  struct hash_table_tests_counter *value = hash_table_tests_points_get(
+    table,
+    origin
+  );
+
+  assert(value && value->count == 1 && value->total == 0.5);
+  value->count++;
+  assert(hash_table_tests_points_get(table, origin)->count == 2);
+
+  // Adding an existing key replaces its value.
+  counter.count = 10;
+  assert(hash_table_tests_points_add(table, origin, counter));
+  assert(hash_table_tests_points_get(table, origin)->count == 10);
+  assert(hash_table_tests_points_get_size(table) == 1);
+
+  assert(hash_table_tests_points_remove(table, origin));
+  assert(hash_table_tests_points_get_size(table) == 0);
+
+  // A grid of points (including negative ones), so the table grows,
+  // then shrinks as they are removed.
+  const int32_t N = 100;
+
+  for (int32_t x = -N; x < N; x++) {
+    for (int32_t y = -N; y < N; y++) {
+
+      struct hash_table_tests_point point = {x, y};
+
+      counter.count = (size_t) ((x + N) * 2 * N + (y + N));
+      counter.total = x * 0.25;
+
+      assert(hash_table_tests_points_add(table, point, counter));
+    }
+  }
+
+  assert(hash_table_tests_points_get_size(table) == (size_t) (4 * N * N));
+
+  for (int32_t x = -N; x < N; x++) {
+    for (int32_t y = -N; y < N; y++) {
+
+      struct hash_table_tests_point point = {x, y};
+
+      value = hash_table_tests_points_get(table, point);
+
+      assert(value);
+      assert(value->count == (size_t) ((x + N) * 2 * N + (y + N)));
+      assert(value->total == x * 0.25);
+    }
+  }
+
+  for (int32_t x = -N; x < N; x++) {
+    for (int32_t y = -N; y < N; y++) {
+
+      struct hash_table_tests_point point = {x, y};
+
+      assert(hash_table_tests_points_remove(table, point));
+      assert(!hash_table_tests_points_get(table, point));
+    }
+  }
+
+  assert(hash_table_tests_points_get_size(table) == 0);
+
+  hash_table_tests_points_free(table);
+
+  // A table which is embedded (rather than allocated by itself).
+  struct {
+    int before;
+    struct hash_table_tests_points points;
+  } owner;
+
+  counter.count = 10;
+
+  assert(hash_table_tests_points_init(&owner.points, 1000));
+  assert(hash_table_tests_points_add(&owner.points, origin, counter));
+  assert(hash_table_tests_points_get(&owner.points, origin)->count == 10);
+  hash_table_tests_points_destroy(&owner.points);
+}
+
+/*
+ * Ensure tables of short keys that are close together work. Nothing
+ * special happens normally, but the tests built with a weak hash (see
+ * RASH_HASH_WEAK) keep reseeding these tables, and falling back to
+ * growing them, so the tables are made many times to be sure of it.
+*/
+static void hash_table_tests_reseed() {
+
+  static int numbers[1000];
+
+  const size_t N = sizeof(numbers) / sizeof(numbers[0]);
+
+  for (int round = 0; round < 32; round++) {
+
+    struct hash_table *table = hash_table_create();
+    assert(table);
+
+    for (size_t i = 0; i < N; i++) {
+      char key[8];
+      snprintf(key, sizeof(key), "%zu", i);
+      assert(hash_table_add(table, key, numbers + i));
+    }
+
+    assert(hash_table_get_size(table) == N);
+
+    for (size_t i = 0; i < N; i++) {
+      char key[8];
+      snprintf(key, sizeof(key), "%zu", i);
+      assert(hash_table_get(table, key) == numbers + i);
+    }
+
+    for (size_t i = 0; i < N; i++) {
+      char key[8];
+      snprintf(key, sizeof(key), "%zu", i);
+      assert(hash_table_remove(table, key));
+      assert(!hash_table_get(table, key));
+    }
+
+    assert(hash_table_get_size(table) == 0);
+    hash_table_free(table);
+  }
+}
+
 int main(void) {
+
+  // First, so that the threads of a parallel build are the first to
+  // hash anything in the process (nothing is set up beforehand).
+  hash_table_tests_add_parallel();
+
   hash_table_tests_create();
+  hash_table_tests_hash_distinct();
   hash_table_tests_add();
   hash_table_tests_add_duplicate();
   hash_table_tests_remove();
@@ -222,6 +1674,28 @@ int main(void) {
   hash_table_tests_get_empty();
   hash_table_tests_add_many();
   hash_table_tests_remove_many();
+  hash_table_tests_custom_functions();
+  hash_table_tests_create_with_capacity();
+  hash_table_tests_reserve();
+  hash_table_tests_resize_grouped();
+  hash_table_tests_incremental();
+  hash_table_tests_reserve_incremental();
+  hash_table_tests_key_lengths();
+  hash_table_tests_churn();
+  hash_table_tests_reseed();
+  hash_table_tests_interner();
+  hash_table_tests_allocator();
+  hash_table_tests_interner_allocator();
+  hash_table_tests_inline_keys();
+  hash_table_tests_huge_pages();
+  hash_table_tests_get_batch();
+  hash_table_tests_add_batch();
+  hash_table_tests_get_or_insert();
+  hash_table_tests_replace();
+  hash_table_tests_key_owners();
+  hash_table_tests_length_keys();
+  hash_table_tests_u64();
+  hash_table_tests_template();
 
   return 0;
 }